@@ -15,6 +15,13 @@ namespace mystl {
 		strict
 	};
 
+	// allocate_at_least 的返回值，同 C++23 std::allocation_result
+	template <class Pointer, class SizeType = std::size_t>
+	struct allocation_result {
+		Pointer ptr;
+		SizeType count;
+	};
+
 	template <class T>
 	struct allocator {
 		using value_type = T;
@@ -50,12 +57,25 @@ namespace mystl {
 			return std::addressof(x);
 		}
 
+		// 单个对象的大小类在编译期确定
 		T* allocate(std::size_t n) {
 			//return static_cast<T*>(::operator new(n * sizeof(T)));
+			if (n == 1) {
+				return static_cast<T*>(mtmalloc::malloc_fixed<sizeof(T)>());
+			}
 			return static_cast<T*>(mtmalloc::malloc(n * sizeof(T)));
 		}
+		// count 为大小类实际能放下的对象个数，deallocate 时传入 count
+		allocation_result<T*> allocate_at_least(std::size_t n) {
+			auto res = mtmalloc::malloc_at_least(n * sizeof(T));
+			return { static_cast<T*>(res.ptr), res.size / sizeof(T) };
+		}
 		void deallocate(T* p, std::size_t n) {
 			//::operator delete(p);
+			if (n == 1) {
+				mtmalloc::free_fixed<sizeof(T)>(p);
+				return;
+			}
 			mtmalloc::free(p);
 		}
 
@@ -69,6 +89,70 @@ namespace mystl {
 		}
 	};
 
+	// 冷数据分配器：很少访问的对象放在单独的 span 中，不占用热数据的 span
+	template <class T>
+	struct cold_allocator : allocator<T> {
+		template <class U>
+		struct rebind {
+			typedef cold_allocator<U> other;
+		};
+
+		using is_always_equal = std::false_type;
+
+		cold_allocator() noexcept {}
+		cold_allocator(const cold_allocator& other) noexcept {}
+
+		template <class U>
+		cold_allocator(const cold_allocator<U>& other) noexcept {}
+
+		T* allocate(std::size_t n) {
+			return static_cast<T*>(mtmalloc::malloc_hint(n * sizeof(T), mtmalloc::hint::cold));
+		}
+		allocation_result<T*> allocate_at_least(std::size_t n) {
+			auto p = allocate(n);
+			return { p, mtmalloc::malloc_usable_size(p) / sizeof(T) };
+		}
+		void deallocate(T* p, std::size_t n) {
+			mtmalloc::free(p);
+		}
+	};
+
+	// allocator::deallocate 按大小类直接放回热数据的线程缓存，不能释放冷 span 中的内存，
+	// 所以 allocator 与 cold_allocator 不相等。cold_allocator 经 mtmalloc::free 释放，
+	// 同类之间可以互相释放
+	template <class T1, class T2>
+	bool operator==(const allocator<T1>& x, const allocator<T2>& y) noexcept {
+		return true;
+	}
+	template <class T1, class T2>
+	bool operator==(const cold_allocator<T1>& x, const cold_allocator<T2>& y) noexcept {
+		return true;
+	}
+	template <class T1, class T2>
+	bool operator==(const allocator<T1>& x, const cold_allocator<T2>& y) noexcept {
+		return false;
+	}
+	template <class T1, class T2>
+	bool operator==(const cold_allocator<T1>& x, const allocator<T2>& y) noexcept {
+		return false;
+	}
+	template <class T1, class T2>
+	bool operator!=(const allocator<T1>& x, const allocator<T2>& y) noexcept {
+		return !(x == y);
+	}
+	template <class T1, class T2>
+	bool operator!=(const cold_allocator<T1>& x, const cold_allocator<T2>& y) noexcept {
+		return !(x == y);
+	}
+	template <class T1, class T2>
+	bool operator!=(const allocator<T1>& x, const cold_allocator<T2>& y) noexcept {
+		return !(x == y);
+	}
+	template <class T1, class T2>
+	bool operator!=(const cold_allocator<T1>& x, const allocator<T2>& y) noexcept {
+		return !(x == y);
+	}
+
 	template <class Alloc>
 	using allocator_traits = std::allocator_traits<Alloc>;
 
@@ -326,34 +410,397 @@ namespace mystl {
 		lhs.swap(rhs);
 	}
 	
-	// 控制块
-	template <class T>
-	struct CtrlBlock {
-		T* ptr_;
-		std::atomic<long> shared_count{1};
+	// 控制块基类：计数与对象类型无关，shared_ptr<T> 与 shared_ptr<Y> 可以共享同一个控制块
+	// 所有 shared_ptr 合起来只持有一个弱引用，复制与销毁 shared_ptr 各只有一次计数操作
+	// Atomic 为 false 时计数是普通整数，见 local_shared_ptr
+	template <bool Atomic>
+	struct BasicCtrlBlockBase {
+		using count_type = std::conditional_t<Atomic, std::atomic<long>, long>;
+
+		count_type shared_count{1};
+		count_type weak_count{1};  // weak_ptr 个数，shared_count 不为 0 时再加 1
+
+		// shared_count 归零时析构对象
+		virtual void destroy() noexcept = 0;
+		// weak_count 归零时释放控制块
+		virtual void deallocate() noexcept = 0;
+
+		// 调用者已持有引用，计数不会在此期间归零，无需同步
+		void add_shared() noexcept {
+			if constexpr (Atomic) {
+				shared_count.fetch_add(1, std::memory_order_relaxed);
+			}
+			else {
+				++shared_count;
+			}
+		}
+		void add_weak() noexcept {
+			if constexpr (Atomic) {
+				weak_count.fetch_add(1, std::memory_order_relaxed);
+			}
+			else {
+				++weak_count;
+			}
+		}
+
+		// release 使本线程对对象的访问先于析构；只有最后一个引用需要 acquire 栅栏，
+		// 看到其他线程的全部访问
+		void release_shared() noexcept {
+			if (sub(shared_count) == 0) {
+				destroy();
+				release_weak();
+			}
+		}
+		void release_weak() noexcept {
+			if (sub(weak_count) == 0) {
+				deallocate();
+			}
+		}
+
+		// weak_ptr::lock：shared_count 为 0 后不能再加，所以用 CAS 而不是 fetch_add
+		bool try_add_shared() noexcept {
+			if constexpr (Atomic) {
+				auto count = shared_count.load(std::memory_order_relaxed);
+				while (count != 0) {
+					if (shared_count.compare_exchange_weak(count, count + 1,
+						std::memory_order_acq_rel, std::memory_order_relaxed)) {
+						return true;
+					}
+				}
+				return false;
+			}
+			else {
+				if (shared_count == 0) {
+					return false;
+				}
+				++shared_count;
+				return true;
+			}
+		}
+
+		long use_count() const noexcept {
+			if constexpr (Atomic) {
+				return shared_count.load(std::memory_order_relaxed);
+			}
+			else {
+				return shared_count;
+			}
+		}
+
+	protected:
+		~BasicCtrlBlockBase() = default;
+
+	private:
+		// 返回减后的值
+		static long sub(count_type& count) noexcept {
+			if constexpr (Atomic) {
+				auto res = count.fetch_sub(1, std::memory_order_release) - 1;
+				if (res == 0) {
+					std::atomic_thread_fence(std::memory_order_acquire);
+				}
+				return res;
+			}
+			else {
+				return --count;
+			}
+		}
+	};
+
+	using CtrlBlockBase = BasicCtrlBlockBase<true>;
+	using LocalCtrlBlockBase = BasicCtrlBlockBase<false>;
+
+	struct BiasedCtrlBlockBase;
+
+	// biased 控制块的创建线程，见 BiasedCtrlBlockBase
+	// 控制块一直指向它，线程退出后不释放：每个创建过 biased 对象的线程留下一个
+	struct BiasedOwner {
+		static constexpr uintptr_t Dead = 1;  // 线程已退出
+
+		std::atomic<uintptr_t> queue_{};  // 等待合并的控制块
+
+		static inline thread_local BiasedOwner* current_{};
+
+		static BiasedOwner* current() noexcept {
+			return current_;
+		}
+		static BiasedOwner* acquire();
+
+		void enqueue(BiasedCtrlBlockBase* block) noexcept;
+		// 由 owner 线程调用
+		void drain() noexcept;
+		static void mergeAll(uintptr_t list) noexcept;
+	};
+
+	// 偏向创建线程的计数（biased reference counting）
+	// 创建线程（owner）只用普通读写修改 biased_count，其他线程原子地修改 shared_count。
+	// owner 的计数归零时把两者合并，之后所有线程都走 shared_count。
+	// 其他线程释放 owner 给出的引用会使 shared_count 为负，此时控制块交给 owner 合并，
+	// 否则总数归零时没有线程知道。因此其他线程放掉最后一个引用后，对象要等 owner 下一次
+	// 创建或释放 biased 对象、lock 失败、调用 drain_biased 或线程退出时才析构；这期间
+	// use_count 为 0，lock 失败。owner 此后不再做这些事时，这些对象一直保留，
+	// 长期不创建也不释放的 owner 应定期调用 drain_biased
+	struct BiasedCtrlBlockBase {
+		// shared_count 是计数乘 One，低两位是标志
+		static constexpr long Merged = 1;  // biased_count 已并入
+		static constexpr long Queued = 2;  // 在 owner 的队列中，由 owner 合并
+		static constexpr long One = 4;
+
+		std::atomic<long> shared_count{};
 		std::atomic<long> weak_count{1};
-		CtrlBlock() : ptr_(nullptr) {}
+		std::atomic<long> biased_count{1};  // 只有 owner 写，读写都是 relaxed 的普通访问
+
+		// shared_count 归零时析构对象
+		virtual void destroy() noexcept = 0;
+		// weak_count 归零时释放控制块
+		virtual void deallocate() noexcept = 0;
+
+		void add_shared() noexcept {
+			if (owned()) {
+				biased_count.store(biased_count.load(std::memory_order_relaxed) + 1,
+					std::memory_order_relaxed);
+			}
+			else {
+				shared_count.fetch_add(One, std::memory_order_relaxed);
+			}
+		}
+		void add_weak() noexcept {
+			weak_count.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		void release_shared() noexcept {
+			auto owner = owner_;
+			if (owned()) {
+				auto count = biased_count.load(std::memory_order_relaxed) - 1;
+				biased_count.store(count, std::memory_order_relaxed);
+				if (count == 0) {
+					merge(false);
+				}
+				// 本控制块可能已释放，只用 owner
+				if (owner->queue_.load(std::memory_order_relaxed) != 0) {
+					owner->drain();
+				}
+				return;
+			}
+
+			auto count = shared_count.fetch_sub(One, std::memory_order_release) - One;
+			if (count == Merged) {
+				std::atomic_thread_fence(std::memory_order_acquire);
+				destroy();
+				release_weak();
+				return;
+			}
+			while (count < 0 && (count & (Merged | Queued)) == 0) {
+				if (shared_count.compare_exchange_weak(count, count | Queued,
+					std::memory_order_relaxed)) {
+					owner->enqueue(this);
+					return;
+				}
+			}
+		}
+		void release_weak() noexcept {
+			if (weak_count.fetch_sub(1, std::memory_order_release) == 1) {
+				std::atomic_thread_fence(std::memory_order_acquire);
+				deallocate();
+			}
+		}
+
+		// 合并前总数是 biased_count 加 shared_count 的计数，与 use_count 一致
+		bool try_add_shared() noexcept {
+			if (owned()) {
+				auto biased = biased_count.load(std::memory_order_relaxed);
+				if (biased + countOf(shared_count.load(std::memory_order_relaxed)) > 0) {
+					biased_count.store(biased + 1, std::memory_order_relaxed);
+					return true;
+				}
+				// 等待合并的控制块可能就是这一个，weak_ptr 仍持有控制块
+				auto owner = owner_;
+				if (owner->queue_.load(std::memory_order_relaxed) != 0) {
+					owner->drain();
+				}
+				return false;
+			}
+			auto count = shared_count.load(std::memory_order_relaxed);
+			for (;;) {
+				auto alive = (count & Merged) != 0 ? count >= One :
+					biased_count.load(std::memory_order_relaxed) + countOf(count) > 0;
+				if (!alive) {
+					return false;
+				}
+				if (shared_count.compare_exchange_weak(count, count + One,
+					std::memory_order_acq_rel, std::memory_order_relaxed)) {
+					return true;
+				}
+			}
+		}
+
+		long use_count() const noexcept {
+			auto count = shared_count.load(std::memory_order_relaxed);
+			auto res = countOf(count);
+			if ((count & Merged) == 0) {
+				res += biased_count.load(std::memory_order_relaxed);
+			}
+			// 其他线程读到的两个计数不是同一时刻的
+			return res > 0 ? res : 0;
+		}
+
+	protected:
+		~BiasedCtrlBlockBase() = default;
+
+	private:
+		friend struct BiasedOwner;
+
+		static long countOf(long count) noexcept {
+			return (count & ~(Merged | Queued)) / One;
+		}
+
+		// owner_ 不变，merged_ 只在 owner_ 是本线程时读
+		bool owned() const noexcept {
+			return owner_ == BiasedOwner::current() && !merged_;
+		}
+
+		// 由 owner 调用，owner 退出后由把控制块放入队列的线程调用。
+		// queued 为 true 时同时清除 Queued
+		void merge(bool queued) noexcept {
+			long add = queued ? -Queued : 0;
+			if (!merged_) {
+				merged_ = true;
+				add += biased_count.load(std::memory_order_relaxed) * One + Merged;
+				biased_count.store(0, std::memory_order_relaxed);
+			}
+			if (shared_count.fetch_add(add, std::memory_order_acq_rel) + add == Merged) {
+				destroy();
+				release_weak();
+			}
+		}
+
+		BiasedOwner* owner_{ BiasedOwner::acquire() };
+		BiasedCtrlBlockBase* next_{};
+		bool merged_{};
+	};
+
+	inline BiasedOwner* BiasedOwner::acquire() {
+		if (current_ == nullptr) {
+			// 线程退出时合并队列中的控制块，之后放入队列的由放入的线程合并
+			struct Exit {
+				BiasedOwner* owner;
+				~Exit() {
+					auto list = owner->queue_.exchange(Dead, std::memory_order_acq_rel);
+					current_ = nullptr;
+					mergeAll(list);
+				}
+			};
+			auto owner = ::new(mystl::allocator<BiasedOwner>{}.allocate(1)) BiasedOwner;
+			static thread_local Exit exit{ owner };
+			current_ = owner;
+		}
+		else if (current_->queue_.load(std::memory_order_relaxed) != 0) {
+			// 只创建、交给其他线程释放的 owner 不会走 release_shared
+			current_->drain();
+		}
+		return current_;
+	}
+
+	inline void BiasedOwner::enqueue(BiasedCtrlBlockBase* block) noexcept {
+		auto head = queue_.load(std::memory_order_acquire);
+		do {
+			if (head == Dead) {
+				// owner 已退出，biased_count 不会再变
+				block->merge(true);
+				return;
+			}
+			block->next_ = reinterpret_cast<BiasedCtrlBlockBase*>(head);
+		} while (!queue_.compare_exchange_weak(head, reinterpret_cast<uintptr_t>(block),
+			std::memory_order_release, std::memory_order_acquire));
+	}
+
+	inline void BiasedOwner::drain() noexcept {
+		mergeAll(queue_.exchange(0, std::memory_order_acquire));
+	}
+
+	// 合并可能析构对象，析构函数又可能放入新的控制块，先取下整条链
+	inline void BiasedOwner::mergeAll(uintptr_t list) noexcept {
+		auto block = reinterpret_cast<BiasedCtrlBlockBase*>(list);
+		while (block != nullptr) {
+			auto next = block->next_;
+			block->merge(true);
+			block = next;
+		}
+	}
+
+	// 对象单独分配，控制块只保存指针
+	template <class T, class Base = CtrlBlockBase>
+	struct CtrlBlock final : Base {
+		T* ptr_;
 		CtrlBlock(T* ptr) : ptr_(ptr) {}
+
+		void destroy() noexcept override {
+			delete ptr_;
+			ptr_ = nullptr;
+		}
+		void deallocate() noexcept override {
+			mystl::allocator<CtrlBlock> alloc;
+			this->~CtrlBlock();
+			alloc.deallocate(this, 1);
+		}
+
+		// 分配失败时释放 ptr，同 std::shared_ptr
+		static CtrlBlock* create(T* ptr) {
+			try {
+				auto p = mystl::allocator<CtrlBlock>{}.allocate(1);
+				return ::new(p) CtrlBlock(ptr);
+			}
+			catch (...) {
+				delete ptr;
+				throw;
+			}
+		}
+	};
+
+	// make_shared/allocate_shared 的控制块：对象就地构造在计数之后，一次分配，
+	// 对象与计数相邻。对象在 shared_count 归零时析构，存储在 weak_count 归零时释放
+	template <class T, class Alloc, class Base = CtrlBlockBase>
+	struct InplaceCtrlBlock final : Base {
+		using allocator_type = typename mystl::allocator_traits<Alloc>::template rebind_alloc<InplaceCtrlBlock>;
+
+		union {
+			T value_;
+		};
+		[[no_unique_address]] allocator_type alloc_;
+
+		template <class... Args>
+		InplaceCtrlBlock(const allocator_type& alloc, Args&&... args) : alloc_(alloc) {
+			::new(static_cast<void*>(&value_)) T(mystl::forward<Args>(args)...);
+		}
+		~InplaceCtrlBlock() {}
+
+		void destroy() noexcept override {
+			value_.~T();
+		}
+		void deallocate() noexcept override {
+			auto alloc = alloc_;
+			this->~InplaceCtrlBlock();
+			mystl::allocator_traits<allocator_type>::deallocate(alloc, this, 1);
+		}
 	};
 
 	// weak_ptr 声明
-	template <class T>
+	template <class T, class Base = CtrlBlockBase>
 	class weak_ptr;
 
 	class bad_weak_ptr : public std::exception {
 	public:
-		/*virtual*/ char const* what() const override {
+		/*virtual*/ char const* what() const noexcept override {
 			return "bad weak ptr";
 		}
 	};
 
 	// shared_ptr
-	template <class T>
+	template <class T, class Base = CtrlBlockBase>
 	class shared_ptr {
 	public:
 		using element_type = T;
 		//using weak_type = mystl::weak_ptr<T>;
-		CtrlBlock<T>* pcb_{};
+		Base* pcb_{};
 		element_type* ptr_{};
 
 	public:
@@ -362,41 +809,34 @@ namespace mystl {
 
 		template <class Y>
 		explicit shared_ptr(Y* ptr) {
-			pcb_ = new CtrlBlock<Y>(ptr);
+			pcb_ = CtrlBlock<Y, Base>::create(ptr);
 			ptr_ = ptr;
 		}
 
 		template <class Y>
-		shared_ptr(const shared_ptr<Y>& r, element_type* ptr) noexcept {
-			pcb_ = reinterpret_cast<CtrlBlock<T>*>(r.pcb_);
+		shared_ptr(const shared_ptr<Y, Base>& r, element_type* ptr) noexcept {
+			pcb_ = r.pcb_;
 			if (pcb_ != nullptr) {
-				++pcb_->shared_count;
-				++pcb_->weak_count;
+				pcb_->add_shared();
 			}
 			ptr_ = ptr;
 		}
 
 		shared_ptr(const shared_ptr& r) noexcept {
-			pcb_ = const_cast<CtrlBlock<T>*>(r.pcb_);
+			pcb_ = r.pcb_;
 			if (pcb_ != nullptr) {
-				++pcb_->shared_count;
-				++pcb_->weak_count;
+				pcb_->add_shared();
 			}
 			ptr_ = const_cast<T*>(r.get());
 		}
 
 		template <class Y>
 			requires std::is_convertible_v<Y*, T*>
-		shared_ptr(const shared_ptr<Y>& r) noexcept {
-			//r.pcb_  CtrlBlock<Y>* const
-			//pcb_    CtrlBlock<T>*
-			//reinterpret_cast
-
+		shared_ptr(const shared_ptr<Y, Base>& r) noexcept {
 			//共享所有权
-			pcb_ = reinterpret_cast<CtrlBlock<T>*>(r.pcb_);
+			pcb_ = r.pcb_;
 			if (pcb_ != nullptr) {
-				++pcb_->shared_count;
-				++pcb_->weak_count;
+				pcb_->add_shared();
 			}
 			ptr_ = const_cast<Y*>(r.get());
 		}
@@ -411,80 +851,70 @@ namespace mystl {
 
 		template <class Y>
 			requires std::is_convertible_v<Y*, T*>
-		shared_ptr(shared_ptr<Y>&& r) noexcept {
-			pcb_ = reinterpret_cast<CtrlBlock<T>*>(r.pcb_);
+		shared_ptr(shared_ptr<Y, Base>&& r) noexcept {
+			pcb_ = r.pcb_;
 			ptr_ = r.get();
 
 			r.pcb_ = nullptr;
 			r.ptr_ = nullptr;
 		}
 
+		// 同 std::shared_ptr，r 已过期时抛出 bad_weak_ptr
 		template <class Y>
-		explicit shared_ptr(const mystl::weak_ptr<Y>& r) {
-			if (r.pcb_ == nullptr) {
-				pcb_ = nullptr;
-				ptr_ = nullptr;
+		explicit shared_ptr(const mystl::weak_ptr<Y, Base>& r) {
+			if (r.pcb_ == nullptr || !r.pcb_->try_add_shared()) {
+				throw mystl::bad_weak_ptr{};
 			}
-			pcb_ = reinterpret_cast<CtrlBlock<T>*>(r.pcb_);
-			++pcb_->shared_count;
-			++pcb_->weak_count;
-			ptr_ = pcb_->ptr_;
+			pcb_ = r.pcb_;
+			ptr_ = r.ptr_;
 		}
 
 		//shared_ptr<int> sp{std::move(up)};
 		template <class Y>
 		shared_ptr(mystl::unique_ptr<Y>&& r) {
 			auto p = r.release();
-			pcb_ = new CtrlBlock<Y>(p);
+			pcb_ = CtrlBlock<Y, Base>::create(p);
 			ptr_ = p;
 		}
 
 		~shared_ptr() {
 			if (pcb_ != nullptr) {
-				if (--pcb_->shared_count == 0) {
-					delete pcb_->ptr_;
-					pcb_->ptr_ = nullptr;
-				}
-				if (--pcb_->weak_count == 0) {
-					delete pcb_;
-					pcb_ = nullptr;
-				}
+				pcb_->release_shared();
+				pcb_ = nullptr;
 			}
 			ptr_ = nullptr;
 		}
 
 		shared_ptr& operator=(const shared_ptr& r) noexcept {
-			shared_ptr<T>(r).swap(*this);
+			shared_ptr(r).swap(*this);
 			return *this;
 		}
 
 		template <class Y>
-		shared_ptr& operator=(const shared_ptr<Y>& r) noexcept {
-			shared_ptr<T>(r).swap(*this);
+		shared_ptr& operator=(const shared_ptr<Y, Base>& r) noexcept {
+			shared_ptr(r).swap(*this);
 			return *this;
 		}
 
 		shared_ptr& operator=(shared_ptr&& r) noexcept {
-			shared_ptr<T>(std::move(r)).swap(*this);
+			shared_ptr(std::move(r)).swap(*this);
 			return *this;
 		}
 
 		template <class Y>
-		shared_ptr& operator=(shared_ptr<Y>&& r) noexcept {
+		shared_ptr& operator=(shared_ptr<Y, Base>&& r) noexcept {
 			//复用移动构造
-			shared_ptr<T>(std::move(r)).swap(*this);
+			shared_ptr(std::move(r)).swap(*this);
 			return *this;
 		}
 		
 		void reset() noexcept {
-			~shared_ptr();
+			shared_ptr().swap(*this);
 		}
 
 		template <class Y>
 		void reset(Y* ptr) {
-			~shared_ptr();
-			pcb_ = new CtrlBlock<Y>(ptr);
-			ptr_ = ptr;
+			shared_ptr(ptr).swap(*this);
 		}
 
 		void swap(shared_ptr& r) noexcept {
@@ -508,14 +938,14 @@ namespace mystl {
 			if (pcb_ == nullptr) {
 				return 0;
 			}
-			return pcb_->shared_count;
+			return pcb_->use_count();
 		}
 		
 		bool unique() const noexcept {
 			if (pcb_ == nullptr) {
 				return 0;
 			}
-			return pcb_->shared_count == 1;
+			return pcb_->use_count() == 1;
 		}
 		
 		explicit operator bool() const noexcept {
@@ -523,245 +953,668 @@ namespace mystl {
 		}
 
 		template <class Y>
-		bool owner_before(const shared_ptr<Y>& other) const noexcept {
+		bool owner_before(const shared_ptr<Y, Base>& other) const noexcept {
 			return pcb_ < other.pcb_;
 		}
 
 		template <class Y>
-		bool owner_before(const weak_ptr<Y>& other) const noexcept {
+		bool owner_before(const weak_ptr<Y, Base>& other) const noexcept {
 			return pcb_ < other.pcb_;
 		}
 	};
 
+	// 单线程使用的 shared_ptr：计数不是原子的，拷贝和析构只是普通加减。
+	// 对象及其所有副本只能在同一线程内使用（或由调用方加锁），与 shared_ptr 之间不能互相转换
+	template <class T>
+	using local_shared_ptr = mystl::shared_ptr<T, LocalCtrlBlockBase>;
+	template <class T>
+	using local_weak_ptr = mystl::weak_ptr<T, LocalCtrlBlockBase>;
+
+	// 主要由创建线程复制和释放的 shared_ptr，见 BiasedCtrlBlockBase。
+	// 其他线程也可以使用，只是走原子计数；与 shared_ptr 之间不能互相转换
+	template <class T>
+	using biased_shared_ptr = mystl::shared_ptr<T, BiasedCtrlBlockBase>;
+	template <class T>
+	using biased_weak_ptr = mystl::weak_ptr<T, BiasedCtrlBlockBase>;
+
+	// 析构其他线程已放掉的、本线程创建的 biased 对象，见 BiasedCtrlBlockBase
+	inline void drain_biased() noexcept {
+		if (auto owner = BiasedOwner::current()) {
+			owner->drain();
+		}
+	}
+
+	// 对象与控制块一次分配，见 InplaceCtrlBlock
+	template <class T, class Base, class Alloc, class... Args>
+	mystl::shared_ptr<T, Base> basic_allocate_shared(const Alloc& alloc, Args&&... args) {
+		using Block = InplaceCtrlBlock<T, Alloc, Base>;
+		using Traits = mystl::allocator_traits<typename Block::allocator_type>;
+
+		typename Block::allocator_type blockAlloc(alloc);
+		auto p = Traits::allocate(blockAlloc, 1);
+		try {
+			::new(static_cast<void*>(p)) Block(blockAlloc, mystl::forward<Args>(args)...);
+		}
+		catch (...) {
+			Traits::deallocate(blockAlloc, p, 1);
+			throw;
+		}
+
+		mystl::shared_ptr<T, Base> res;
+		res.pcb_ = p;
+		res.ptr_ = &p->value_;
+		return res;
+	}
+
+	template <class T, class Alloc, class... Args>
+	mystl::shared_ptr<T> allocate_shared(const Alloc& alloc, Args&&... args) {
+		return mystl::basic_allocate_shared<T, CtrlBlockBase>(alloc, mystl::forward<Args>(args)...);
+	}
+
+	// 经 mystl::allocator 分配，控制块的大小类在编译期确定
 	template <class T, class... Args>
 	mystl::shared_ptr<T> make_shared(Args&&... args) {
-		return shared_ptr<T>(new T(mystl::forward<Args>(args)...));
+		return mystl::allocate_shared<T>(mystl::allocator<T>{}, mystl::forward<Args>(args)...);
 	}
 
-	template<class T, class U>
-	mystl::shared_ptr<T> static_pointer_cast(const mystl::shared_ptr<U>& r) noexcept {
-		auto p = static_cast<typename mystl::shared_ptr<T>::element_type*>(r.get());
-		return mystl::shared_ptr<T>{r, p};
+	template <class T, class Alloc, class... Args>
+	mystl::local_shared_ptr<T> allocate_local_shared(const Alloc& alloc, Args&&... args) {
+		return mystl::basic_allocate_shared<T, LocalCtrlBlockBase>(alloc, mystl::forward<Args>(args)...);
+	}
+
+	template <class T, class... Args>
+	mystl::local_shared_ptr<T> make_local_shared(Args&&... args) {
+		return mystl::allocate_local_shared<T>(mystl::allocator<T>{}, mystl::forward<Args>(args)...);
 	}
 
-	template<class T, class U>
-	mystl::shared_ptr<T> dynamic_pointer_cast(const mystl::shared_ptr<U>& r) noexcept {
-		if (auto p = dynamic_cast<typename mystl::shared_ptr<T>::element_type*>(r.get())) {
-			return mystl::shared_ptr<T>{r, p};
+	// 对象偏向调用线程
+	template <class T, class Alloc, class... Args>
+	mystl::biased_shared_ptr<T> allocate_biased_shared(const Alloc& alloc, Args&&... args) {
+		return mystl::basic_allocate_shared<T, BiasedCtrlBlockBase>(alloc, mystl::forward<Args>(args)...);
+	}
+
+	template <class T, class... Args>
+	mystl::biased_shared_ptr<T> make_biased_shared(Args&&... args) {
+		return mystl::allocate_biased_shared<T>(mystl::allocator<T>{}, mystl::forward<Args>(args)...);
+	}
+
+	template <class T, class U, class B>
+	mystl::shared_ptr<T, B> static_pointer_cast(const mystl::shared_ptr<U, B>& r) noexcept {
+		auto p = static_cast<typename mystl::shared_ptr<T, B>::element_type*>(r.get());
+		return mystl::shared_ptr<T, B>{r, p};
+	}
+
+	template <class T, class U, class B>
+	mystl::shared_ptr<T, B> dynamic_pointer_cast(const mystl::shared_ptr<U, B>& r) noexcept {
+		if (auto p = dynamic_cast<typename mystl::shared_ptr<T, B>::element_type*>(r.get())) {
+			return mystl::shared_ptr<T, B>{r, p};
 		} else {
-			return mystl::shared_ptr<T>{};
+			return mystl::shared_ptr<T, B>{};
 		}
 	}
 
-	template<class T, class U>
-	mystl::shared_ptr<T> const_pointer_cast(const mystl::shared_ptr<U>& r) noexcept {
-		auto p = const_cast<typename mystl::shared_ptr<T>::element_type*>(r.get());
-		return mystl::shared_ptr<T>{r, p};
+	template <class T, class U, class B>
+	mystl::shared_ptr<T, B> const_pointer_cast(const mystl::shared_ptr<U, B>& r) noexcept {
+		auto p = const_cast<typename mystl::shared_ptr<T, B>::element_type*>(r.get());
+		return mystl::shared_ptr<T, B>{r, p};
 	}
 
-	template<class T, class U>
-	mystl::shared_ptr<T> reinterpret_pointer_cast(const mystl::shared_ptr<U>& r) noexcept {
-		auto p = reinterpret_cast<typename mystl::shared_ptr<T>::element_type*>(r.get());
-		return mystl::shared_ptr<T>{r, p};
+	template <class T, class U, class B>
+	mystl::shared_ptr<T, B> reinterpret_pointer_cast(const mystl::shared_ptr<U, B>& r) noexcept {
+		auto p = reinterpret_cast<typename mystl::shared_ptr<T, B>::element_type*>(r.get());
+		return mystl::shared_ptr<T, B>{r, p};
 	}
 
-	template <class T, class U>
-	bool operator==(const mystl::shared_ptr<T>& lhs, 
-		const mystl::shared_ptr<U>& rhs) noexcept {
+	template <class T, class U, class B>
+	bool operator==(const mystl::shared_ptr<T, B>& lhs, 
+		const mystl::shared_ptr<U, B>& rhs) noexcept {
 		return lhs.get() == rhs.get();
 	}
-	template <class T, class U>
-	bool operator!=(const mystl::shared_ptr<T>& lhs,
-		const mystl::shared_ptr<U>& rhs) noexcept {
+	template <class T, class U, class B>
+	bool operator!=(const mystl::shared_ptr<T, B>& lhs,
+		const mystl::shared_ptr<U, B>& rhs) noexcept {
 		return !(lhs == rhs);
 	}
-	template <class T, class U>
-	bool operator<(const mystl::shared_ptr<T>& lhs,
-		const mystl::shared_ptr<U>& rhs) noexcept {
+	template <class T, class U, class B>
+	bool operator<(const mystl::shared_ptr<T, B>& lhs,
+		const mystl::shared_ptr<U, B>& rhs) noexcept {
 		return lhs.get() < rhs.get();
 	}
-	template <class T, class U>
-	bool operator>(const mystl::shared_ptr<T>& lhs,
-		const mystl::shared_ptr<U>& rhs) noexcept {
+	template <class T, class U, class B>
+	bool operator>(const mystl::shared_ptr<T, B>& lhs,
+		const mystl::shared_ptr<U, B>& rhs) noexcept {
 		return rhs < lhs;
 	}
-	template <class T, class U>
-	bool operator<=(const mystl::shared_ptr<T>& lhs,
-		const mystl::shared_ptr<U>& rhs) noexcept {
+	template <class T, class U, class B>
+	bool operator<=(const mystl::shared_ptr<T, B>& lhs,
+		const mystl::shared_ptr<U, B>& rhs) noexcept {
 		return !(rhs < lhs);
 	}
-	template <class T, class U>
-	bool operator>=(const mystl::shared_ptr<T>& lhs,
-		const mystl::shared_ptr<U>& rhs) noexcept {
+	template <class T, class U, class B>
+	bool operator>=(const mystl::shared_ptr<T, B>& lhs,
+		const mystl::shared_ptr<U, B>& rhs) noexcept {
 		return !(lhs < rhs);
 	}
 
-	template <class T>
-	bool operator==(const mystl::shared_ptr<T>& lhs, std::nullptr_t) noexcept {
+	template <class T, class B>
+	bool operator==(const mystl::shared_ptr<T, B>& lhs, std::nullptr_t) noexcept {
 		return lhs == nullptr;
 	}
-	template <class T>
-	bool operator==(std::nullptr_t, const mystl::shared_ptr<T>& lhs) noexcept {
+	template <class T, class B>
+	bool operator==(std::nullptr_t, const mystl::shared_ptr<T, B>& lhs) noexcept {
 		return nullptr == lhs;
 	}
-	template <class T>
-	bool operator!=(const mystl::shared_ptr<T>& lhs, std::nullptr_t) noexcept {
+	template <class T, class B>
+	bool operator!=(const mystl::shared_ptr<T, B>& lhs, std::nullptr_t) noexcept {
 		return !(lhs);
 	}
-	template <class T>
-	bool operator!=(std::nullptr_t, const mystl::shared_ptr<T>& lhs) noexcept {
+	template <class T, class B>
+	bool operator!=(std::nullptr_t, const mystl::shared_ptr<T, B>& lhs) noexcept {
 		return !(lhs);
 	}
-	template <class T>
-	bool operator<(const mystl::shared_ptr<T>& lhs, std::nullptr_t) noexcept {
+	template <class T, class B>
+	bool operator<(const mystl::shared_ptr<T, B>& lhs, std::nullptr_t) noexcept {
 		return lhs.get() < nullptr;
 	}
-	template <class T>
-	bool operator<(std::nullptr_t, const mystl::shared_ptr<T>& lhs) noexcept {
+	template <class T, class B>
+	bool operator<(std::nullptr_t, const mystl::shared_ptr<T, B>& lhs) noexcept {
 		return nullptr < lhs;
 	}
-	template <class T>
-	bool operator>(const mystl::shared_ptr<T>& lhs, std::nullptr_t) noexcept {
+	template <class T, class B>
+	bool operator>(const mystl::shared_ptr<T, B>& lhs, std::nullptr_t) noexcept {
 		return nullptr < lhs;
 	}
-	template <class T>
-	bool operator>(std::nullptr_t, const mystl::shared_ptr<T>& lhs) noexcept {
+	template <class T, class B>
+	bool operator>(std::nullptr_t, const mystl::shared_ptr<T, B>& lhs) noexcept {
 		return lhs < nullptr;
 	}
-	template <class T>
-	bool operator<=(const mystl::shared_ptr<T>& lhs, std::nullptr_t) noexcept {
+	template <class T, class B>
+	bool operator<=(const mystl::shared_ptr<T, B>& lhs, std::nullptr_t) noexcept {
 		return !(nullptr < lhs);
 	}
-	template <class T>
-	bool operator<=(std::nullptr_t, const mystl::shared_ptr<T>& lhs) noexcept {
+	template <class T, class B>
+	bool operator<=(std::nullptr_t, const mystl::shared_ptr<T, B>& lhs) noexcept {
 		return !(lhs < nullptr);
 	}
-	template <class T>
-	bool operator>=(const mystl::shared_ptr<T>&lhs, std::nullptr_t) noexcept {
+	template <class T, class B>
+	bool operator>=(const mystl::shared_ptr<T, B>&lhs, std::nullptr_t) noexcept {
 		return !(lhs < nullptr);
 	}
-	template <class T>
-	bool operator>=(std::nullptr_t, const mystl::shared_ptr<T>& lhs) noexcept {
+	template <class T, class B>
+	bool operator>=(std::nullptr_t, const mystl::shared_ptr<T, B>& lhs) noexcept {
 		return !(nullptr < lhs);
 	}
 
-	template <class T>
-	void swap(mystl::shared_ptr<T>& lhs, mystl::shared_ptr<T>& rhs) noexcept {
+	template <class T, class B>
+	void swap(mystl::shared_ptr<T, B>& lhs, mystl::shared_ptr<T, B>& rhs) noexcept {
 		lhs.swap(rhs);
 	}
 
 	// 向日葵连线 review 到此
 	
 	// weak_ptr
-	template <class T>
+	template <class T, class Base>
 	class weak_ptr {
 	public:
 		using element_type = T;
 
-		CtrlBlock<T>* pcb_{};
+		Base* pcb_{};
+		element_type* ptr_{};  // lock 得到的 shared_ptr 指向它
 
 		constexpr weak_ptr() noexcept {}
 		weak_ptr(const weak_ptr& r) noexcept {
-			pcb_ = const_cast<CtrlBlock<T>*>(r.pcb_);
+			pcb_ = r.pcb_;
 			if (pcb_ != nullptr) {
-				++pcb_->weak_count;
+				pcb_->add_weak();
 			}
+			ptr_ = r.ptr_;
 		}
 		template <class Y>
 			requires std::is_convertible_v<Y*, T*>
-		weak_ptr(const weak_ptr<Y>& r) noexcept {
-			pcb_ = reinterpret_cast<CtrlBlock<T>*>(r.pcb_);
+		weak_ptr(const weak_ptr<Y, Base>& r) noexcept {
+			pcb_ = r.pcb_;
 			if (pcb_ != nullptr) {
-				++pcb_->weak_count;
+				pcb_->add_weak();
 			}
+			ptr_ = r.ptr_;
 		}
 
 		template <class Y>
 			requires std::is_convertible_v<Y*, T*>
-		weak_ptr(const mystl::shared_ptr<Y>& r) noexcept {
-			pcb_ = reinterpret_cast<CtrlBlock<T>*>(r.pcb_);
+		weak_ptr(const mystl::shared_ptr<Y, Base>& r) noexcept {
+			pcb_ = r.pcb_;
 			if (pcb_ != nullptr) {
-				++pcb_->weak_count;
+				pcb_->add_weak();
 			}
+			ptr_ = r.ptr_;
 		}
 
 		weak_ptr(weak_ptr&& r) noexcept {
 			pcb_ = r.pcb_;
+			ptr_ = r.ptr_;
 
 			r.pcb_ = nullptr;
+			r.ptr_ = nullptr;
 		}
 		template <class Y>
 			requires std::is_convertible_v<Y*, T*>
-		weak_ptr(weak_ptr<Y>&& r) noexcept {
-			pcb_ = reinterpret_cast<CtrlBlock<T>*>(r.pcb_);
+		weak_ptr(weak_ptr<Y, Base>&& r) noexcept {
+			pcb_ = r.pcb_;
+			ptr_ = r.ptr_;
 
 			r.pcb_ = nullptr;
+			r.ptr_ = nullptr;
 		}
 
 		~weak_ptr() {
 			if (pcb_ != nullptr) {
-				if (--pcb_->weak_count == 0) {
-					delete pcb_;
-				}
+				pcb_->release_weak();
 				pcb_ = nullptr;
 			}
+			ptr_ = nullptr;
 		}
 
 		weak_ptr& operator=(const weak_ptr& r) noexcept {
-			mystl::weak_ptr<T>(r).swap(*this);
+			weak_ptr(r).swap(*this);
 			return *this;
 		}
 		template <class Y>
-		weak_ptr& operator=(const weak_ptr<Y>& r) noexcept {
-			mystl::weak_ptr<T>(r).swap(*this);
+		weak_ptr& operator=(const weak_ptr<Y, Base>& r) noexcept {
+			weak_ptr(r).swap(*this);
 			return *this;
 		}
 
 		weak_ptr& operator=(weak_ptr&& r) noexcept {
-			mystl::weak_ptr<T>(mystl::move(r)).swap(*this);
+			weak_ptr(mystl::move(r)).swap(*this);
 			return *this;
 		}
 		template <class Y>
-		weak_ptr& operator=(weak_ptr<Y>&& r) noexcept {
-			mystl::weak_ptr<T>(mystl::move(r)).swap(*this);
+		weak_ptr& operator=(weak_ptr<Y, Base>&& r) noexcept {
+			weak_ptr(mystl::move(r)).swap(*this);
 			return *this;
 		}
 
 		void reset() noexcept {
-			~weak_ptr();
+			weak_ptr().swap(*this);
 		}
 
 		void swap(weak_ptr& r) noexcept {
 			mystl::swap(pcb_, r.pcb_);
+			mystl::swap(ptr_, r.ptr_);
 		}
 
 		long use_count() const noexcept {
 			if (pcb_ == nullptr) {
 				return 0;
 			}
-			return pcb_->shared_count;
+			return pcb_->use_count();
 		}
 
 		bool expried() const noexcept {
 			return use_count() == 0;
 		}
 
-		mystl::shared_ptr<T> lock() const noexcept {
-			return expried() ? shared_ptr<T>{} : shared_ptr<T>{ *this };
+		// 先检查再加计数会与最后一个 shared_ptr 的销毁竞争，由 try_add_shared 一步完成
+		mystl::shared_ptr<T, Base> lock() const noexcept {
+			mystl::shared_ptr<T, Base> res;
+			if (pcb_ != nullptr && pcb_->try_add_shared()) {
+				res.pcb_ = pcb_;
+				res.ptr_ = ptr_;
+			}
+			return res;
 		}
 
 		template <class Y>
-		bool owner_before(const weak_ptr<Y>& other) const noexcept {
+		bool owner_before(const weak_ptr<Y, Base>& other) const noexcept {
 			return pcb_ < other.pcb_;
 		}
 		template <class Y>
-		bool owner_before(const mystl::shared_ptr<Y>& other) const noexcept {
+		bool owner_before(const mystl::shared_ptr<Y, Base>& other) const noexcept {
 			return pcb_ < other.pcb_;
 		}
 	};
 
-	template <class T>
-	void swap(mystl::weak_ptr<T>& lhs, mystl::weak_ptr<T>& rhs) noexcept {
+	template <class T, class B>
+	void swap(mystl::weak_ptr<T, B>& lhs, mystl::weak_ptr<T, B>& rhs) noexcept {
 		lhs.swap(rhs);
 	}
+
+	// atomic_shared_ptr 的延迟回收（hazard pointer）
+	// 写者换下的节点没有被读者登记时立即释放，否则挂到全局链表，之后的写入再检查
+	struct HazardNode {
+		HazardNode* next_{};
+		void (*reclaim_)(HazardNode*) noexcept {};
+	};
+
+	// 读者登记正在读的节点。记录只增不删，线程退出后留给新线程复用；
+	// 每个记录独占一条缓存行，读者之间不共享写入
+	struct alignas(64) HazardRecord {
+		std::atomic<const HazardNode*> node_{};
+		std::atomic<bool> active_{};
+		HazardRecord* next_{};
+
+		static inline std::atomic<HazardRecord*> head_{};
+		// 换下时仍被登记的节点
+		static inline std::atomic<HazardNode*> retired_{};
+
+		static HazardRecord* acquire() {
+			for (auto p = head_.load(std::memory_order_acquire); p != nullptr; p = p->next_) {
+				if (!p->active_.load(std::memory_order_relaxed) &&
+					!p->active_.exchange(true, std::memory_order_acquire)) {
+					return p;
+				}
+			}
+
+			auto p = ::new(mystl::allocator<HazardRecord>{}.allocate(1)) HazardRecord;
+			p->active_.store(true, std::memory_order_relaxed);
+			auto head = head_.load(std::memory_order_relaxed);
+			do {
+				p->next_ = head;
+			} while (!head_.compare_exchange_weak(head, p, std::memory_order_release,
+				std::memory_order_relaxed));
+			return p;
+		}
+
+		void release() noexcept {
+			node_.store(nullptr, std::memory_order_release);
+			active_.store(false, std::memory_order_release);
+		}
+
+		static bool isProtected(const HazardNode* node) noexcept {
+			for (auto p = head_.load(std::memory_order_acquire); p != nullptr; p = p->next_) {
+				if (p->node_.load(std::memory_order_seq_cst) == node) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		static void pushRetired(HazardNode* node) noexcept {
+			node->next_ = retired_.load(std::memory_order_relaxed);
+			while (!retired_.compare_exchange_weak(node->next_, node, std::memory_order_release,
+				std::memory_order_relaxed)) {
+			}
+		}
+	};
+
+	// 线程自己的登记记录
+	class HazardThread {
+	public:
+		static constexpr size_t LocalRecords = 4;
+
+		static HazardThread& local() {
+			static thread_local HazardThread instance;
+			return instance;
+		}
+
+		HazardThread(const HazardThread&) = delete;
+		HazardThread& operator=(const HazardThread&) = delete;
+
+		// 嵌套读取超过 LocalRecords 层时临时借用一个空闲记录
+		HazardRecord* take() {
+			for (size_t i = 0; i < LocalRecords; ++i) {
+				if ((busy_ & (1u << i)) == 0) {
+					if (records_[i] == nullptr) {
+						records_[i] = HazardRecord::acquire();
+					}
+					busy_ |= 1u << i;
+					return records_[i];
+				}
+			}
+			return HazardRecord::acquire();
+		}
+
+		void give(HazardRecord* record) noexcept {
+			for (size_t i = 0; i < LocalRecords; ++i) {
+				if (records_[i] == record) {
+					record->node_.store(nullptr, std::memory_order_release);
+					busy_ &= ~(1u << i);
+					return;
+				}
+			}
+			record->release();
+		}
+
+		// node 已从源中换下。检查一次登记记录，开销与读者线程数成正比
+		static void retire(HazardNode* node) noexcept {
+			if (HazardRecord::isProtected(node)) {
+				HazardRecord::pushRetired(node);
+			}
+			else {
+				node->reclaim_(node);
+			}
+			scan();
+		}
+
+		// 再检查仍被登记的节点。回收节点会析构其中的对象，
+		// 对象的析构函数可能再次 retire，此时不嵌套 scan。
+		// 不用 local()：全局 atomic_shared_ptr 析构时线程对象可能已经析构
+		static void scan() noexcept {
+			if (scanning_ || HazardRecord::retired_.load(std::memory_order_relaxed) == nullptr) {
+				return;
+			}
+			scanning_ = true;
+
+			auto list = HazardRecord::retired_.exchange(nullptr, std::memory_order_acquire);
+			while (list != nullptr) {
+				auto node = list;
+				list = node->next_;
+				if (HazardRecord::isProtected(node)) {
+					HazardRecord::pushRetired(node);
+				}
+				else {
+					node->reclaim_(node);
+				}
+			}
+			scanning_ = false;
+		}
+
+	private:
+		HazardThread() = default;
+
+		~HazardThread() {
+			for (auto record : records_) {
+				if (record != nullptr) {
+					record->release();
+				}
+			}
+		}
+
+		HazardRecord* records_[LocalRecords]{};
+		unsigned busy_{};
+		static inline thread_local bool scanning_{};
+	};
+
+	// 在本线程登记一个节点，guard 存活期间该节点不会被回收
+	class HazardGuard {
+	public:
+		HazardGuard() : thread_(HazardThread::local()), record_(thread_.take()) {}
+		~HazardGuard() {
+			thread_.give(record_);
+		}
+
+		HazardGuard(const HazardGuard&) = delete;
+		HazardGuard& operator=(const HazardGuard&) = delete;
+
+		// 登记后再读一次 src：仍是同一节点，说明登记早于任何写者对它的 retire
+		template <class Node>
+		Node* protect(const std::atomic<Node*>& src) noexcept {
+			auto node = src.load(std::memory_order_relaxed);
+			for (;;) {
+				record_->node_.store(node, std::memory_order_seq_cst);
+				auto current = src.load(std::memory_order_seq_cst);
+				if (current == node) {
+					return node;
+				}
+				node = current;
+			}
+		}
+
+		void clear() noexcept {
+			record_->node_.store(nullptr, std::memory_order_release);
+		}
+
+	private:
+		HazardThread& thread_;
+		HazardRecord* record_;
+	};
+
+	// 读多写少的 shared_ptr 发布，同 std::atomic<std::shared_ptr<T>>
+	// 每次写入换上一个保存 shared_ptr 的新节点，旧节点由 hazard pointer 延迟回收，
+	// load/store/exchange/compare_exchange 都不加锁。读者只写本线程的登记记录：
+	// snapshot 的开销不随读者线程数增长，load 多一次对象计数的原子加。
+	// 换下的值没有读者持有时在写入中立即释放；被读者持有的，在读者放开后
+	// 任意线程的下一次写入或任意 atomic_shared_ptr 析构时释放
+	template <class T>
+	class atomic_shared_ptr {
+		struct Node : HazardNode {
+			mystl::shared_ptr<T> value_;
+
+			explicit Node(mystl::shared_ptr<T>&& value) : value_(mystl::move(value)) {
+				reclaim_ = &Node::destroy;
+			}
+
+			// 空 shared_ptr 不分配节点
+			static Node* create(mystl::shared_ptr<T>&& value) {
+				if (value.pcb_ == nullptr && value.ptr_ == nullptr) {
+					return nullptr;
+				}
+				return ::new(mystl::allocator<Node>{}.allocate(1)) Node(mystl::move(value));
+			}
+
+			static void destroy(HazardNode* node) noexcept {
+				auto p = static_cast<Node*>(node);
+				p->~Node();
+				mystl::allocator<Node>{}.deallocate(p, 1);
+			}
+		};
+
+	public:
+		using value_type = mystl::shared_ptr<T>;
+
+		// 不复制 shared_ptr 的读取，对象在 guard 析构前不会被释放。
+		// guard 只能在创建它的线程使用
+		class snapshot_guard {
+		public:
+			snapshot_guard(const snapshot_guard&) = delete;
+			snapshot_guard& operator=(const snapshot_guard&) = delete;
+
+			T* get() const noexcept {
+				return node_ != nullptr ? node_->value_.get() : nullptr;
+			}
+			T& operator*() const noexcept {
+				return *get();
+			}
+			T* operator->() const noexcept {
+				return get();
+			}
+			explicit operator bool() const noexcept {
+				return get() != nullptr;
+			}
+
+		private:
+			friend class atomic_shared_ptr;
+
+			explicit snapshot_guard(const std::atomic<Node*>& src) : node_(guard_.protect(src)) {}
+
+			HazardGuard guard_;
+			const Node* node_;
+		};
+
+		constexpr atomic_shared_ptr() noexcept {}
+		atomic_shared_ptr(mystl::shared_ptr<T> desired) : node_(Node::create(mystl::move(desired))) {}
+
+		atomic_shared_ptr(const atomic_shared_ptr&) = delete;
+		atomic_shared_ptr& operator=(const atomic_shared_ptr&) = delete;
+
+		// 析构时不能再有其他线程访问，当前节点直接释放，读者已放开的旧节点一并释放
+		~atomic_shared_ptr() {
+			if (auto node = node_.load(std::memory_order_relaxed)) {
+				Node::destroy(node);
+			}
+			HazardThread::scan();
+		}
+
+		void operator=(mystl::shared_ptr<T> desired) {
+			store(mystl::move(desired));
+		}
+
+		operator mystl::shared_ptr<T>() const {
+			return load();
+		}
+
+		snapshot_guard snapshot() const {
+			return snapshot_guard(node_);
+		}
+
+		mystl::shared_ptr<T> load() const {
+			HazardGuard guard;
+			auto node = guard.protect(node_);
+			return node != nullptr ? node->value_ : mystl::shared_ptr<T>{};
+		}
+
+		void store(mystl::shared_ptr<T> desired) {
+			retire(node_.exchange(Node::create(mystl::move(desired))));
+		}
+
+		// 换下的节点可能仍有读者在复制其中的 shared_ptr，只能复制不能移出
+		mystl::shared_ptr<T> exchange(mystl::shared_ptr<T> desired) {
+			auto old = node_.exchange(Node::create(mystl::move(desired)));
+			if (old == nullptr) {
+				return {};
+			}
+			auto res = old->value_;
+			retire(old);
+			return res;
+		}
+
+		// 相等指 get() 与所有权都相同。失败时 expected 换成当前值
+		bool compare_exchange_strong(mystl::shared_ptr<T>& expected, mystl::shared_ptr<T> desired) {
+			HazardGuard guard;
+			Node* fresh = nullptr;
+			bool created = false;
+			auto current = guard.protect(node_);
+			for (;;) {
+				if (!equivalent(current, expected)) {
+					expected = current != nullptr ? current->value_ : mystl::shared_ptr<T>{};
+					if (fresh != nullptr) {
+						Node::destroy(fresh);
+					}
+					return false;
+				}
+				if (!created) {
+					fresh = Node::create(mystl::move(desired));
+					created = true;
+				}
+				if (node_.compare_exchange_strong(current, fresh)) {
+					guard.clear();
+					retire(current);
+					return true;
+				}
+				// current 已是新值但尚未登记
+				current = guard.protect(node_);
+			}
+		}
+
+		// 没有伪失败
+		bool compare_exchange_weak(mystl::shared_ptr<T>& expected, mystl::shared_ptr<T> desired) {
+			return compare_exchange_strong(expected, mystl::move(desired));
+		}
+
+	private:
+		static bool equivalent(const Node* node, const mystl::shared_ptr<T>& value) noexcept {
+			if (node == nullptr) {
+				return value.pcb_ == nullptr && value.ptr_ == nullptr;
+			}
+			return node->value_.pcb_ == value.pcb_ && node->value_.ptr_ == value.ptr_;
+		}
+
+		static void retire(Node* node) noexcept {
+			if (node != nullptr) {
+				HazardThread::retire(node);
+			}
+		}
+
+		std::atomic<Node*> node_{};
+	};
 }
\ No newline at end of file
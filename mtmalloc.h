@@ -13,10 +13,40 @@
  */
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
 #include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(MTMALLOC_TRACE)
+#include <chrono>
+#include <cstdio>
+#endif
+
+#if defined(MTMALLOC_TAGS)
+#include <cmath>
+#include <unordered_map>
+#endif
+
+#if defined(MTMALLOC_SIZE_CLASSES_HEADER)
+#include <array>
+// defines mtmalloc::detail::SizeClasses, see tools/sizeclass_gen.cpp
+#include MTMALLOC_SIZE_CLASSES_HEADER
+#endif
+
+#if defined(MTMALLOC_LATENCY_STATS) || defined(MTMALLOC_CONTENTION_STATS)
+#include <chrono>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#endif
 
 #if defined(_WIN32)
 
@@ -37,51 +67,420 @@
 #include <sys/mman.h>
 #include <unistd.h>
 
+#if defined(MTMALLOC_NUMA)
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
 #else
  // TODO: support other platform
 #endif
 
 namespace mtmalloc {
 
+    /*
+     * Trace Format
+     */
+
+    // a trace file is a trace_header followed by trace_records in no particular
+    // order; sort by seq to get the global order of operations
+    enum class trace_op : uint8_t {
+        malloc,
+        free,
+        realloc,
+    };
+
+    struct trace_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t record_size;
+    };
+
+    inline constexpr char trace_magic[8]{ 'M', 'T', 'T', 'R', 'A', 'C', 'E', '\0' };
+    inline constexpr uint32_t trace_version = 1;
+
+    struct trace_record {
+        uint64_t seq;        // taken before a free and after a malloc
+        uint64_t timestamp;  // nanoseconds since trace_start
+        uint64_t ptr;        // pointer id: returned by malloc/realloc, or freed
+        uint64_t old_ptr;    // realloc only
+        uint64_t size;       // requested bytes
+        uint32_t thread;     // dense id per traced thread
+        trace_op op;
+        uint8_t reserved[3];
+    };
+
+    static_assert(sizeof(trace_record) == 48);
+
+    /*
+     * Latency Stats Types
+     */
+
+    // slow paths timed when built with MTMALLOC_LATENCY_STATS
+    enum class latency_path {
+        fetch_from_central_cache,  // ThreadCache::fetchFromCentralCache
+        fetch_from_page_cache,     // CentralCache::fetchFromPageCache
+        page_heap_allocate,        // PageHeap::allocate
+        page_heap_deallocate,      // PageHeap::deallocate
+        sys_alloc,                 // SysAlloc
+        sys_free,                  // SysFree
+        count,
+    };
+
+    // log-linear histogram of TSC ticks: every power of two is split into
+    // 4 linear sub-buckets, so a bucket is at most 25% wide
+    struct latency_histogram {
+        static constexpr size_t sub_bucket_bits = 2;
+        static constexpr size_t bucket_num = (64 - sub_bucket_bits + 1) << sub_bucket_bits;
+
+        uint64_t count;
+        uint64_t sum;
+        uint64_t max;
+        uint64_t buckets[bucket_num];
+
+        static constexpr size_t bucket_of(uint64_t ticks) {
+            if (ticks < (uint64_t{ 1 } << sub_bucket_bits)) {
+                return static_cast<size_t>(ticks);
+            }
+            size_t exp = 0;
+            for (auto v = ticks; v > 1; v >>= 1) {
+                ++exp;
+            }
+            auto sub = (ticks >> (exp - sub_bucket_bits)) & ((1 << sub_bucket_bits) - 1);
+            return ((exp - sub_bucket_bits + 1) << sub_bucket_bits) + sub;
+        }
+
+        // smallest value that falls into bucket i
+        static constexpr uint64_t bucket_lower(size_t i) {
+            if (i < (size_t{ 1 } << sub_bucket_bits)) {
+                return i;
+            }
+            auto exp = (i >> sub_bucket_bits) + sub_bucket_bits - 1;
+            auto sub = i & ((size_t{ 1 } << sub_bucket_bits) - 1);
+            return ((uint64_t{ 1 } << sub_bucket_bits) + sub) << (exp - sub_bucket_bits);
+        }
+
+        // upper bound of the bucket holding the p-th percentile, p in [0, 100]
+        [[nodiscard]] uint64_t percentile(double p) const {
+            if (count == 0) {
+                return 0;
+            }
+            auto rank = static_cast<uint64_t>(p / 100.0 * static_cast<double>(count - 1));
+            uint64_t seen = 0;
+            for (size_t i = 0; i < bucket_num; ++i) {
+                seen += buckets[i];
+                if (seen > rank) {
+                    return i + 1 < bucket_num ? std::min(bucket_lower(i + 1) - 1, max) : max;
+                }
+            }
+            return max;
+        }
+    };
+
+    /*
+     * Lock Stats Types
+     */
+
+    // counters of one allocator lock when built with MTMALLOC_CONTENTION_STATS
+    struct lock_stats {
+        uint64_t acquisitions;
+        uint64_t contended;       // acquisitions that had to wait
+        uint64_t wait_ticks;      // TSC ticks spent waiting
+        uint64_t max_hold_ticks;  // longest time the lock was held
+    };
+
+    /*
+     * Memory Limit Types
+     */
+
+    // called when the heap grows past the soft limit despite reclaiming
+    using soft_limit_callback = void (*)(size_t heap_bytes, size_t limit);
+
+    /*
+     * Allocation Hint Types
+     */
+
+    // cold memory is rarely touched, it is kept in spans of its own so hot
+    // spans stay dense, and its pages go back to the OS as soon as they are free
+    enum class hint : uint8_t {
+        hot,
+        cold,
+    };
+
+    /*
+     * Heap Walk Types
+     */
+
+    struct span_info {
+        void* begin;
+        size_t page_count;
+        size_t size;       // memblock size, 0 for a free span
+        int size_class;    // bucket index, -1 for free spans and large objects
+        size_t objects;    // memblocks the span is carved into
+        size_t use_count;  // memblocks handed out, those in thread caches included
+        bool in_use;
+        bool cold;
+        bool released;     // free pages given back to the OS
+        size_t node;       // NUMA node whose memory backs the span, 0 without MTMALLOC_NUMA
+    };
+
+    /*
+     * Config Types
+     */
+
+    // runtime tuning, see set_config. At startup it is read from MTMALLOC_CONF
+    // as comma-separated key:value pairs, sizes may end in k, m or g, e.g.
+    // MTMALLOC_CONF=thread_cache_bytes:8m,slow_start:false,release_rate:1
+    struct config {
+        size_t thread_cache_bytes{};          // memblocks a thread may cache, 0 for no limit
+        bool slow_start{ true };              // a thread's list grows by one memblock per miss
+        size_t batch_bytes{ 256 * 1024 };     // bytes moved per thread cache transfer
+        size_t batch_min{ 2 };                // memblocks per transfer, bounds of
+        size_t batch_max{ 512 };              // batch_bytes / size
+        double release_rate{};                // free pages go back to the OS sooner the
+                                              // higher it is, 0 for only under a soft limit
+        size_t large_threshold{ 256 * 1024 }; // larger requests skip the caches, at most 256K
+        size_t span_pages{ 1 };               // least pages carved into one small span
+    };
+
+#if defined(MTMALLOC_NUMA)
+
+    /*
+     * NUMA Types
+     */
+
+    inline constexpr size_t numa_max_nodes = 8;
+
+    // how the page heap sees the machine: each node keeps its own free spans
+    // and buckets, and a thread refills from the node of the CPU it runs on.
+    // The default asks the kernel; set_numa_topology replaces it, e.g. to
+    // simulate nodes on a single-node host
+    struct numa_topology {
+        size_t (*node_count)();    // clamped to numa_max_nodes
+        size_t (*current_node)();  // node of the calling thread's CPU
+        void (*bind)(void* ptr, size_t bytes, size_t node);  // place fresh pages on node
+    };
+
+#endif
+
+    /*
+     * Tag Types
+     */
+
+    // attributes memory to a tenant or subsystem, 0 is untagged
+    using tag_t = uint8_t;
+
+    inline constexpr size_t tag_num = 256;
+
+    struct tag_stats {
+        uint64_t allocated_bytes;    // size-class bytes ever allocated, exact
+        uint64_t allocated_objects;
+        uint64_t live_bytes;         // exact for large objects, sampled for small ones
+        uint64_t live_objects;
+    };
+
     namespace detail {
 
         inline constexpr size_t TCMaxSize = 256 * 1024;
 
         // for thread cache and central cache
+#if defined(MTMALLOC_SIZE_CLASSES_HEADER)
+        inline constexpr size_t MaxBucketNum = sizeof(SizeClasses) / sizeof(SizeClasses[0]);
+#else
         inline constexpr size_t MaxBucketNum = 208;
+#endif
 
         // for page heap
         inline constexpr size_t MaxPageNum = 129;
 
-        // assume page size >= 4KB
+        // page heaps and central cache buckets, one each without MTMALLOC_NUMA
+#if defined(MTMALLOC_NUMA)
+        inline constexpr size_t MaxNodeNum = numa_max_nodes;
+#else
+        inline constexpr size_t MaxNodeNum = 1;
+#endif
+
+        // assume OS page size is 4KB
+        inline constexpr size_t SysPageShift = 12;
+
+        // logical page of the page heap; larger pages mean fewer page map
+        // entries and spans, at the cost of coarser span sizes
+#if defined(MTMALLOC_PAGE_SHIFT)
+        inline constexpr size_t PageShift = MTMALLOC_PAGE_SHIFT;
+#else
         inline constexpr size_t PageShift = 12;
+#endif
+
+        // 64KB is the allocation granularity of VirtualAlloc, the most that
+        // comes aligned without trimming on every platform
+        static_assert(PageShift >= SysPageShift && PageShift <= 16,
+            "MTMALLOC_PAGE_SHIFT must be between 12 (4KB) and 16 (64KB)");
+
+        // fixed before the first allocation, see Config
+        inline config settings{};
+
+#if defined(MTMALLOC_LATENCY_STATS) || defined(MTMALLOC_CONTENTION_STATS)
+
+        inline uint64_t readCycles() {
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+            return __rdtsc();
+#elif defined(__aarch64__)
+            uint64_t res;
+            asm volatile("mrs %0, cntvct_el0" : "=r"(res));
+            return res;
+#else
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+        }
+
+#endif
+
+#if defined(MTMALLOC_LATENCY_STATS)
+
+        class LatencyHistogram {
+        public:
+            void record(uint64_t ticks) {
+                counts_[latency_histogram::bucket_of(ticks)].fetch_add(
+                    1, std::memory_order_relaxed);
+                sum_.fetch_add(ticks, std::memory_order_relaxed);
+                auto max = max_.load(std::memory_order_relaxed);
+                while (ticks > max &&
+                    !max_.compare_exchange_weak(max, ticks, std::memory_order_relaxed)) {
+                }
+            }
+
+            void read(latency_histogram& res) const {
+                res.count = 0;
+                for (size_t i = 0; i < latency_histogram::bucket_num; ++i) {
+                    res.buckets[i] = counts_[i].load(std::memory_order_relaxed);
+                    res.count += res.buckets[i];
+                }
+                res.sum = sum_.load(std::memory_order_relaxed);
+                res.max = max_.load(std::memory_order_relaxed);
+            }
+
+            void reset() {
+                for (auto& count : counts_) {
+                    count.store(0, std::memory_order_relaxed);
+                }
+                sum_.store(0, std::memory_order_relaxed);
+                max_.store(0, std::memory_order_relaxed);
+            }
+
+        private:
+            std::atomic<uint64_t> counts_[latency_histogram::bucket_num]{};
+            std::atomic<uint64_t> sum_{};
+            std::atomic<uint64_t> max_{};
+        };
+
+        // constant-initialized, so SysAlloc can record before any Singleton exists
+        inline LatencyHistogram latencyHistograms[static_cast<size_t>(latency_path::count)];
+
+        class LatencyTimer {
+        public:
+            explicit LatencyTimer(latency_path path) : path_(path), begin_(readCycles()) {}
+
+            ~LatencyTimer() {
+                latencyHistograms[static_cast<size_t>(path_)].record(readCycles() - begin_);
+            }
+
+            LatencyTimer(const LatencyTimer&) = delete;
+            LatencyTimer& operator=(const LatencyTimer&) = delete;
+
+        private:
+            latency_path path_;
+            uint64_t begin_;
+        };
+
+#endif
+
+        // bytes mapped from the OS, and how much of that was released but kept mapped
+        inline std::atomic<size_t> mappedBytes{};
+        inline std::atomic<size_t> releasedBytes{};
 
-        inline void* SysAlloc(size_t size) {
+        // mapped for spans, page map nodes and thread caches, see ObjectPool
+        inline std::atomic<size_t> metadataBytes{};
+
+        // the result is aligned to a logical page; with populate the pages
+        // are faulted in before returning
+        inline void* SysAlloc(size_t size, bool populate = false) {
+#if defined(MTMALLOC_LATENCY_STATS)
+            LatencyTimer timer{ latency_path::sys_alloc };
+#endif
 #if defined(_WIN32)
             void* ptr =
                 VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
             if (ptr == nullptr) {
                 throw std::bad_alloc{};
             }
+            for (size_t i = 0; populate && i < size; i += size_t{ 1 } << SysPageShift) {
+                static_cast<volatile char*>(ptr)[i] = 0;
+            }
 #elif defined(__linux__) || defined(linux)
-            void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
-                MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+            // mmap only aligns to the OS page, map a logical page more and trim
+            constexpr auto slack = PageShift > SysPageShift ? size_t{ 1 } << PageShift : 0;
+            void* ptr = mmap(nullptr, size + slack, PROT_READ | PROT_WRITE,
+                MAP_ANONYMOUS | MAP_PRIVATE | (populate ? MAP_POPULATE : 0), -1, 0);
             if (ptr == MAP_FAILED) {
                 throw std::bad_alloc{};
             }
+            if constexpr (slack != 0) {
+                constexpr auto sysPage = size_t{ 1 } << SysPageShift;
+                auto begin = reinterpret_cast<uintptr_t>(ptr);
+                auto aligned = (begin + slack - 1) & ~(slack - 1);
+                auto end = aligned + ((size + sysPage - 1) & ~(sysPage - 1));
+                if (aligned > begin) {
+                    munmap(ptr, aligned - begin);
+                }
+                if (begin + size + slack > end) {
+                    munmap(reinterpret_cast<void*>(end), begin + size + slack - end);
+                }
+                ptr = reinterpret_cast<void*>(aligned);
+            }
 #else
             // TODO: support other platform
 #endif
+            mappedBytes.fetch_add(size, std::memory_order_relaxed);
             return ptr;
         }
 
         inline void SysFree(void* ptr, size_t size) {
+#if defined(MTMALLOC_LATENCY_STATS)
+            LatencyTimer timer{ latency_path::sys_free };
+#endif
 #if defined(_WIN32)
             VirtualFree(ptr, size, MEM_RELEASE);
 #elif defined(__linux__) || defined(linux)
             munmap(ptr, size);
 #else
             // TODO: support other platform
+#endif
+            mappedBytes.fetch_sub(size, std::memory_order_relaxed);
+        }
+
+        // give the physical pages back but keep the address range
+        inline void SysRelease(void* ptr, size_t size) {
+#if defined(_WIN32)
+            VirtualFree(ptr, size, MEM_DECOMMIT);
+#elif defined(__linux__) || defined(linux)
+            madvise(ptr, size, MADV_DONTNEED);
+#else
+            // TODO: support other platform
+#endif
+        }
+
+        // make released pages usable again
+        inline void SysCommit(void* ptr, size_t size) {
+#if defined(_WIN32)
+            if (VirtualAlloc(ptr, size, MEM_COMMIT, PAGE_READWRITE) == nullptr) {
+                throw std::bad_alloc{};
+            }
+#else
+            // touching released pages faults fresh zero pages in
+            (void)ptr;
+            (void)size;
 #endif
         }
 
@@ -96,14 +495,66 @@ namespace mtmalloc {
             int useCount_{};
 
             bool isUsing_{};
+            bool isReleased_{};  // free pages given back with SysRelease
+            bool isCold_{};      // holds memory from malloc_hint(..., hint::cold)
+            uint8_t node_{};     // NUMA node the pages were bound to
+
+#if defined(MTMALLOC_TAGS)
+            tag_t tag_{};                      // owner of a large object
+            std::atomic<uint32_t> samples_{};  // sampled memblocks, see Tagger
+#endif
 
             Span* next_{};
             Span* prev_{};
         };
 
+#if defined(MTMALLOC_SIZE_CLASSES_HEADER)
+
+        // a generated table is looked up by slot, as tcmalloc does: request
+        // bytes by 8 up to 1K and by 128 above. So classes up to 1K must be
+        // multiples of 8, larger ones multiples of 128, and the last TCMaxSize
+        constexpr size_t sizeClassSlot(size_t bytes) {
+            return bytes <= 1024 ? (bytes + 7) >> 3 : (bytes + 127 + (120 << 7)) >> 7;
+        }
+
+        constexpr bool validSizeClasses() {
+            for (size_t i = 0; i < MaxBucketNum; ++i) {
+                auto size = SizeClasses[i];
+                if (size == 0 || size % (size <= 1024 ? 8 : 128) != 0 ||
+                    (i > 0 && size <= SizeClasses[i - 1])) {
+                    return false;
+                }
+            }
+            return MaxBucketNum <= 256 && SizeClasses[MaxBucketNum - 1] == TCMaxSize;
+        }
+
+        static_assert(validSizeClasses(), "MTMALLOC_SIZE_CLASSES_HEADER: invalid SizeClasses");
+
+        // slot -> bucket index
+        inline constexpr auto SizeClassIndex = [] {
+            std::array<uint8_t, sizeClassSlot(TCMaxSize) + 1> res{};
+            size_t index = 0;
+            for (size_t slot = 0; slot < res.size(); ++slot) {
+                auto bytes = slot <= 128 ? slot << 3 : (slot - 120) << 7;
+                while (SizeClasses[index] < bytes) {
+                    ++index;
+                }
+                res[slot] = static_cast<uint8_t>(index);
+            }
+            return res;
+        }();
+
+#endif
+
         class Helper {
         public:
-            static size_t bytesToSize(size_t bytes) {
+            static constexpr size_t bytesToSize(size_t bytes) {
+#if defined(MTMALLOC_SIZE_CLASSES_HEADER)
+                if (bytes <= TCMaxSize) {
+                    return SizeClasses[SizeClassIndex[sizeClassSlot(bytes)]];
+                }
+                return align(bytes, 8 * 1024);
+#else
                 if (bytes <= 128) {
                     return align(bytes, 8);
                 }
@@ -119,13 +570,17 @@ namespace mtmalloc {
                 else {
                     return align(bytes, 8 * 1024);
                 }
+#endif
             }
 
             // for thread cache and central cache
-            static size_t bytesToIndex(size_t bytes) {
+            static constexpr size_t bytesToIndex(size_t bytes) {
                 assert(bytes > 0 && bytes <= TCMaxSize);
 
-                static int groups[4]{ 16, 56, 56, 56 };
+#if defined(MTMALLOC_SIZE_CLASSES_HEADER)
+                return SizeClassIndex[sizeClassSlot(bytes)];
+#else
+                constexpr size_t groups[4]{ 16, 56, 56, 56 };
                 if (bytes <= 128) {
                     return indexInGroup(bytes, 3);
                 }
@@ -146,23 +601,32 @@ namespace mtmalloc {
                 else {
                     return -1;
                 }
+#endif
             }
 
             static size_t sizeToBatch(size_t size) {
                 assert(size > 0);
 
-                auto res = TCMaxSize / size;
-                res = std::max(res, size_t{ 2 });
-                res = std::min(res, size_t{ 512 });
+                auto res = settings.batch_bytes / size;
+                res = std::max(res, settings.batch_min);
+                res = std::min(res, settings.batch_max);
                 return res;
             }
 
+            // pages of a span carved into memblocks of size
             static size_t sizeToPageNum(size_t size) {
                 assert(size > 0);
 
                 auto res = (sizeToBatch(size) * size) >> PageShift;
-                res = std::max(res, size_t{ 1 });
-                return res;
+                res = std::max(res, settings.span_pages);
+                res = std::min(res, MaxPageNum - 1);
+                return std::max(res, ((size - 1) >> PageShift) + 1);
+            }
+
+            // pages of a span holding one large object of size
+            static constexpr size_t largeToPageNum(size_t size) {
+                assert(size > 0);
+                return ((size - 1) >> PageShift) + 1;
             }
 
             // get the head of memblock to record the next memblock's address
@@ -191,15 +655,153 @@ namespace mtmalloc {
             }
 
         private:
-            static size_t align(size_t bytes, size_t alignNum) {
+            static constexpr size_t align(size_t bytes, size_t alignNum) {
                 return (bytes + alignNum - 1) & ~(alignNum - 1);
             }
 
-            static size_t indexInGroup(size_t bytes, size_t alignShift) {
+            static constexpr size_t indexInGroup(size_t bytes, size_t alignShift) {
                 return ((bytes + (1 << alignShift) - 1) >> alignShift) - 1;
             }
         };
 
+        // parses MTMALLOC_CONF and guards settings once the heap is in use
+        class Config {
+        public:
+            static bool valid(const config& conf) {
+                return conf.batch_bytes > 0 && conf.batch_min > 0 &&
+                    conf.batch_min <= conf.batch_max && conf.release_rate >= 0 &&
+                    conf.large_threshold > 0 && conf.large_threshold <= TCMaxSize &&
+                    conf.span_pages > 0 && conf.span_pages < MaxPageNum;
+            }
+
+            // routing compares request bytes with the threshold and freeing
+            // compares memblock sizes with it, so it must be a class size
+            static bool apply(config conf) {
+                if (frozen_.load(std::memory_order_acquire) || !valid(conf)) {
+                    return false;
+                }
+                conf.large_threshold = Helper::bytesToSize(conf.large_threshold);
+                settings = conf;
+                return true;
+            }
+
+            // called by the page heap, which every first allocation reaches
+            static void freeze() { frozen_.store(true, std::memory_order_release); }
+
+            static bool frozen() { return frozen_.load(std::memory_order_acquire); }
+
+            // update conf with the pairs in text, return false if any pair was
+            // malformed; well-formed pairs are kept either way
+            static bool parse(const char* text, config& conf) {
+                auto res = true;
+                while (*text != '\0') {
+                    auto end = text + std::strcspn(text, ",");
+                    auto colon = static_cast<const char*>(
+                        std::memchr(text, ':', static_cast<size_t>(end - text)));
+                    res = colon != nullptr &&
+                        parsePair(text, static_cast<size_t>(colon - text), colon + 1, end,
+                            conf) && res;
+                    text = *end == ',' ? end + 1 : end;
+                }
+                return res;
+            }
+
+            static bool loadEnvironment() {
+                auto text = std::getenv("MTMALLOC_CONF");
+                if (text == nullptr) {
+                    return false;
+                }
+                auto conf = settings;
+                parse(text, conf);
+                return apply(conf);
+            }
+
+        private:
+            static bool parsePair(const char* key, size_t keyLength, const char* value,
+                const char* end, config& conf) {
+                auto is = [&](const char* name) {
+                    return std::strlen(name) == keyLength &&
+                        std::strncmp(key, name, keyLength) == 0;
+                };
+
+                if (is("thread_cache_bytes")) {
+                    return parseSize(value, end, conf.thread_cache_bytes);
+                }
+                if (is("slow_start")) {
+                    return parseBool(value, end, conf.slow_start);
+                }
+                if (is("batch_bytes")) {
+                    return parseSize(value, end, conf.batch_bytes);
+                }
+                if (is("batch_min")) {
+                    return parseSize(value, end, conf.batch_min);
+                }
+                if (is("batch_max")) {
+                    return parseSize(value, end, conf.batch_max);
+                }
+                if (is("release_rate")) {
+                    char* last{};
+                    auto res = std::strtod(value, &last);
+                    if (last != end || value == end) {
+                        return false;
+                    }
+                    conf.release_rate = res;
+                    return true;
+                }
+                if (is("large_threshold")) {
+                    return parseSize(value, end, conf.large_threshold);
+                }
+                if (is("span_pages")) {
+                    return parseSize(value, end, conf.span_pages);
+                }
+                return false;
+            }
+
+            static bool parseSize(const char* value, const char* end, size_t& res) {
+                if (value == end || *value < '0' || *value > '9') {
+                    return false;
+                }
+                char* last{};
+                auto n = std::strtoull(value, &last, 10);
+                if (last + 1 == end) {
+                    switch (*last) {
+                    case 'k': case 'K': n <<= 10; ++last; break;
+                    case 'm': case 'M': n <<= 20; ++last; break;
+                    case 'g': case 'G': n <<= 30; ++last; break;
+                    default: break;
+                    }
+                }
+                if (last != end) {
+                    return false;
+                }
+                res = static_cast<size_t>(n);
+                return true;
+            }
+
+            static bool parseBool(const char* value, const char* end, bool& res) {
+                auto length = static_cast<size_t>(end - value);
+                auto is = [&](const char* name) {
+                    return std::strlen(name) == length &&
+                        std::strncmp(value, name, length) == 0;
+                };
+                if (is("true") || is("1")) {
+                    res = true;
+                    return true;
+                }
+                if (is("false") || is("0")) {
+                    res = false;
+                    return true;
+                }
+                return false;
+            }
+
+            static inline std::atomic<bool> frozen_{};
+        };
+
+        // dynamic initialization of an inline variable runs before that of
+        // anything defined after this header in the same translation unit
+        inline const bool configLoaded = Config::loadEnvironment();
+
         template <typename T>
         class Singleton {
         public:
@@ -232,6 +834,8 @@ namespace mtmalloc {
             ThreadLocalSingleton() = default;
         };
 
+        // objects are carved from chunks of at least 64KB, so metadata costs
+        // one mapping per chunk rather than an OS page per object
         template <typename T>
         class ObjectPool final : public ThreadLocalSingleton<ObjectPool<T>> {
             friend class ThreadLocalSingleton<ObjectPool<T>>;
@@ -246,7 +850,14 @@ namespace mtmalloc {
                     freeList_ = next;
                 }
                 else {
-                    res = static_cast<T*>(SysAlloc(sizeof(T)));
+                    if (chunkLeft_ < sizeof(T)) {
+                        chunk_ = static_cast<char*>(SysAlloc(ChunkSize));
+                        chunkLeft_ = ChunkSize;
+                        metadataBytes.fetch_add(ChunkSize, std::memory_order_relaxed);
+                    }
+                    res = reinterpret_cast<T*>(chunk_);
+                    chunk_ += sizeof(T);
+                    chunkLeft_ -= sizeof(T);
                 }
 
                 new (res) T{};
@@ -264,7 +875,12 @@ namespace mtmalloc {
             }
 
         private:
+            static constexpr size_t ChunkAlign = 64 * 1024;
+            static constexpr size_t ChunkSize = (sizeof(T) + ChunkAlign - 1) & ~(ChunkAlign - 1);
+
             void* freeList_{};
+            char* chunk_{};
+            size_t chunkLeft_{};
         };
 
         // PageMap contains a mapping from page to Span
@@ -389,83 +1005,319 @@ namespace mtmalloc {
             Span* dummy_{};
         };
 
-        class PageHeap final : public Singleton<PageHeap> {
-            friend class Singleton<PageHeap>;
-            PageHeap() = default;
+#if defined(MTMALLOC_CONTENTION_STATS)
 
+        // std::mutex that counts acquisitions, contended acquisitions, time spent
+        // waiting and the longest hold
+        class ProfiledMutex {
         public:
-            // allocate Span
-            Span* allocate(size_t pageNum) {
-                assert(pageNum > 0);
+            void lock() {
+                if (!mtx_.try_lock()) {
+                    auto begin = readCycles();
+                    mtx_.lock();
+                    add(contended_, 1);
+                    add(waitTicks_, readCycles() - begin);
+                }
+                acquired();
+            }
 
-                if (pageNum >= MaxPageNum) {
-                    auto ptr = SysAlloc(pageNum << PageShift);
-                    auto res = ObjectPool<Span>::getInstance().new_();
-                    res->firstPageId_ = Helper::addressToPageId(ptr);
-                    res->firstPageOffset_ = Helper::addressToPageOffset(ptr);
-                    res->pageCount_ = pageNum;
-                    for (size_t i = 0; i < res->pageCount_; i++) {
-                        PageMap<Bits>::getInstance().set(res->firstPageId_ + i, res);
-                    }
-                    return res;
+            bool try_lock() {
+                if (!mtx_.try_lock()) {
+                    return false;
                 }
+                acquired();
+                return true;
+            }
 
-                if (!freeLists_[pageNum].empty()) {
-                    auto res = freeLists_[pageNum].pop();
-                    for (size_t i = 0; i < res->pageCount_; i++) {
-                        PageMap<Bits>::getInstance().set(res->firstPageId_ + i, res);
-                    }
-                    return res;
+            void unlock() {
+                auto hold = readCycles() - holdBegin_;
+                if (hold > maxHoldTicks_.load(std::memory_order_relaxed)) {
+                    maxHoldTicks_.store(hold, std::memory_order_relaxed);
                 }
+                mtx_.unlock();
+            }
 
-                for (auto i = pageNum + 1; i < MaxPageNum; i++) {
-                    if (!freeLists_[i].empty()) {
-                        auto t = freeLists_[i].pop();
+            void read(lock_stats& res) const {
+                res.acquisitions = acquisitions_.load(std::memory_order_relaxed);
+                res.contended = contended_.load(std::memory_order_relaxed);
+                res.wait_ticks = waitTicks_.load(std::memory_order_relaxed);
+                res.max_hold_ticks = maxHoldTicks_.load(std::memory_order_relaxed);
+            }
 
-                        auto res = ObjectPool<Span>::getInstance().new_();
-                        res->firstPageId_ = t->firstPageId_;
-                        res->firstPageOffset_ = t->firstPageOffset_;
-                        res->pageCount_ = pageNum;
-                        for (size_t j = 0; j < res->pageCount_; j++) {
-                            PageMap<Bits>::getInstance().set(res->firstPageId_ + j, res);
-                        }
+            void reset() {
+                std::lock_guard<std::mutex> lock{ mtx_ };
+                acquisitions_.store(0, std::memory_order_relaxed);
+                contended_.store(0, std::memory_order_relaxed);
+                waitTicks_.store(0, std::memory_order_relaxed);
+                maxHoldTicks_.store(0, std::memory_order_relaxed);
+            }
 
-                        t->firstPageId_ += pageNum;
-                        t->pageCount_ -= pageNum;
-                        freeLists_[t->pageCount_].push(t);
-                        PageMap<Bits>::getInstance().set(t->firstPageId_, t);
-                        PageMap<Bits>::getInstance().set(t->firstPageId_ + t->pageCount_ - 1,
-                            t);
-                        return res;
-                    }
-                }
+        private:
+            // counters only change while mtx_ is held, so no read-modify-write is needed
+            static void add(std::atomic<uint64_t>& counter, uint64_t n) {
+                counter.store(counter.load(std::memory_order_relaxed) + n,
+                    std::memory_order_relaxed);
+            }
 
-                // new a big Span
-                auto res = ObjectPool<Span>::getInstance().new_();
-                auto ptr = SysAlloc((MaxPageNum - 1) << PageShift);
-                res->firstPageId_ = Helper::addressToPageId(ptr);
-                res->firstPageOffset_ = Helper::addressToPageOffset(ptr);
-                res->pageCount_ = MaxPageNum - 1;
-                freeLists_[res->pageCount_].push(res);
-                return allocate(pageNum);
+            void acquired() {
+                add(acquisitions_, 1);
+                holdBegin_ = readCycles();
             }
 
-            // deallocate Span
-            void deallocate(Span* span) {
-                assert(span != nullptr);
+        private:
+            std::mutex mtx_;
+            uint64_t holdBegin_{};
 
-                if (span->pageCount_ >= MaxPageNum) {
-                    auto ptr = Helper::spanToBeginAddress(span);
-                    SysFree(ptr, span->pageCount_ << PageShift);
-                    ObjectPool<Span>::getInstance().delete_(span);
-                    return;
-                }
+            std::atomic<uint64_t> acquisitions_{};
+            std::atomic<uint64_t> contended_{};
+            std::atomic<uint64_t> waitTicks_{};
+            std::atomic<uint64_t> maxHoldTicks_{};
+        };
 
-                while (true) {
-                    auto prevPageId = span->firstPageId_ - 1;
-                    auto prevSpan = PageMap<Bits>::getInstance().get(prevPageId);
-                    if (prevSpan == nullptr) {
-                        break;
+        using Mutex = ProfiledMutex;
+
+#else
+
+        using Mutex = std::mutex;
+
+#endif
+
+        // bumped to ask every ThreadCache to return its lists on its next slow path
+        inline std::atomic<uint64_t> flushEpoch{};
+
+        class SoftLimit final : public Singleton<SoftLimit> {
+            friend class Singleton<SoftLimit>;
+            SoftLimit() = default;
+
+        public:
+            void set(size_t limit, soft_limit_callback callback) {
+                callback_.store(callback, std::memory_order_relaxed);
+                limit_.store(limit, std::memory_order_release);
+            }
+
+            [[nodiscard]] size_t limit() const {
+                return limit_.load(std::memory_order_acquire);
+            }
+
+            // mapped bytes that may still be resident
+            static size_t heapBytes() {
+                auto mapped = mappedBytes.load(std::memory_order_relaxed);
+                auto released = releasedBytes.load(std::memory_order_relaxed);
+                return mapped > released ? mapped - released : 0;
+            }
+
+            // reclaiming starts when the heap would grow past 7/8 of the limit
+            [[nodiscard]] bool approaching(size_t extra) const {
+                auto limit = this->limit();
+                return limit != 0 && heapBytes() + extra > limit - limit / 8;
+            }
+
+            [[nodiscard]] bool exceeded(size_t extra) const {
+                auto limit = this->limit();
+                return limit != 0 && heapBytes() + extra > limit;
+            }
+
+            void markExceeded() { pending_.store(true, std::memory_order_relaxed); }
+
+            // must be called without holding any allocator lock
+            void notify() {
+                if (!pending_.load(std::memory_order_relaxed) ||
+                    !pending_.exchange(false, std::memory_order_acquire)) {
+                    return;
+                }
+                if (auto callback = callback_.load(std::memory_order_relaxed)) {
+                    callback(heapBytes(), limit());
+                }
+            }
+
+        private:
+            std::atomic<size_t> limit_{};  // 0 means no limit
+            std::atomic<soft_limit_callback> callback_{};
+            std::atomic<bool> pending_{};
+        };
+
+        // the topology is read once, at the first allocation
+        class Numa final : public Singleton<Numa> {
+            friend class Singleton<Numa>;
+            Numa() {
+#if defined(MTMALLOC_NUMA)
+                Config::freeze();
+                nodeCount_ = std::clamp(topology_.node_count(), size_t{ 1 }, MaxNodeNum);
+#endif
+            }
+
+        public:
+            [[nodiscard]] size_t nodeCount() const { return nodeCount_; }
+
+            [[nodiscard]] size_t currentNode() const {
+#if defined(MTMALLOC_NUMA)
+                if (nodeCount_ == 1) {
+                    return 0;
+                }
+                auto res = topology_.current_node();
+                return res < nodeCount_ ? res : 0;
+#else
+                return 0;
+#endif
+            }
+
+            // must be called before the pages are first touched
+            void bind(void* ptr, size_t bytes, size_t node) const {
+#if defined(MTMALLOC_NUMA)
+                if (nodeCount_ > 1) {
+                    topology_.bind(ptr, bytes, node);
+                }
+#else
+                (void)ptr;
+                (void)bytes;
+                (void)node;
+#endif
+            }
+
+#if defined(MTMALLOC_NUMA)
+            static bool setTopology(const numa_topology& topology) {
+                if (Config::frozen() || topology.node_count == nullptr ||
+                    topology.current_node == nullptr || topology.bind == nullptr) {
+                    return false;
+                }
+                topology_ = topology;
+                return true;
+            }
+
+            static numa_topology systemTopology() {
+                return { systemNodeCount, systemCurrentNode, systemBind };
+            }
+
+        private:
+            // read with open/read rather than stdio, which may allocate
+            static size_t systemNodeCount() {
+#if defined(__linux__) || defined(linux)
+                auto fd = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+                if (fd < 0) {
+                    return 1;
+                }
+                char text[256]{};
+                auto length = read(fd, text, sizeof(text) - 1);
+                close(fd);
+
+                // ranges such as 0-1 or 0,2-3, the last number is the highest node
+                size_t res = 0, cur = 0;
+                for (ssize_t i = 0; i < length; ++i) {
+                    if (text[i] >= '0' && text[i] <= '9') {
+                        cur = cur * 10 + static_cast<size_t>(text[i] - '0');
+                        res = cur;
+                    }
+                    else {
+                        cur = 0;
+                    }
+                }
+                return res + 1;
+#else
+                // TODO: support other platform
+                return 1;
+#endif
+            }
+
+            static size_t systemCurrentNode() {
+#if defined(__linux__) || defined(linux)
+                unsigned cpu{}, node{};
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+                // through the vDSO, no system call
+                if (getcpu(&cpu, &node) != 0) {
+                    return 0;
+                }
+#else
+                if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) {
+                    return 0;
+                }
+#endif
+                return node;
+#else
+                return 0;
+#endif
+            }
+
+            // MPOL_PREFERRED rather than MPOL_BIND: a full node falls back to
+            // another one instead of failing the page fault. Placement is
+            // only a hint, so errors such as EPERM in a container are ignored
+            static void systemBind(void* ptr, size_t bytes, size_t node) {
+#if defined(__linux__) || defined(linux)
+                constexpr int preferred = 1;  // MPOL_PREFERRED, numaif.h needs libnuma
+                unsigned long mask = 1ul << node;
+                syscall(SYS_mbind, ptr, bytes, preferred, &mask, sizeof(mask) * 8, 0);
+#else
+                (void)ptr;
+                (void)bytes;
+                (void)node;
+#endif
+            }
+
+            static inline numa_topology topology_{ systemNodeCount, systemCurrentNode,
+                systemBind };
+#endif
+
+        private:
+            size_t nodeCount_{ 1 };
+        };
+
+        class PageHeap final : public Singleton<PageHeap> {
+            friend class Singleton<PageHeap>;
+            PageHeap() { Config::freeze(); }
+
+        public:
+            // allocate Span backed by node's memory
+            Span* allocate(size_t pageNum, size_t node) {
+#if defined(MTMALLOC_LATENCY_STATS)
+                LatencyTimer timer{ latency_path::page_heap_allocate };
+#endif
+                assert(node < MaxNodeNum);
+                auto res = allocateSpan(pageNum, node);
+                if (res->isReleased_) {
+                    auto bytes = res->pageCount_ << PageShift;
+                    SysCommit(Helper::spanToBeginAddress(res), bytes);
+                    releasedBytes.fetch_sub(bytes, std::memory_order_relaxed);
+                    res->isReleased_ = false;
+                }
+                return res;
+            }
+
+            // allocate a Span for one object above the large threshold
+            Span* allocateLarge(size_t pageNum, size_t size) {
+                auto res = allocate(pageNum, Numa::getInstance().currentNode());
+                res->size_ = size;
+                res->isUsing_ = true;
+                largeSpans_.push(res);
+                return res;
+            }
+
+            // deallocate Span
+            void deallocate(Span* span) {
+                assert(span != nullptr);
+#if defined(MTMALLOC_LATENCY_STATS)
+                LatencyTimer timer{ latency_path::page_heap_deallocate };
+#endif
+
+                if (span->size_ > settings.large_threshold) {
+                    largeSpans_.erase(span);
+                }
+
+                if (span->pageCount_ >= MaxPageNum) {
+                    // the span object is reused, a neighbour merging later must
+                    // not find it through stale entries
+                    for (size_t i = 0; i < span->pageCount_; i++) {
+                        PageMap<Bits>::getInstance().set(span->firstPageId_ + i, nullptr);
+                    }
+                    auto ptr = Helper::spanToBeginAddress(span);
+                    SysFree(ptr, span->pageCount_ << PageShift);
+                    ObjectPool<Span>::getInstance().delete_(span);
+                    return;
+                }
+
+                while (true) {
+                    auto prevPageId = span->firstPageId_ - 1;
+                    auto prevSpan = PageMap<Bits>::getInstance().get(prevPageId);
+                    if (prevSpan == nullptr) {
+                        break;
                     }
                     if (prevSpan->isUsing_) {
                         break;
@@ -473,12 +1325,16 @@ namespace mtmalloc {
                     if (prevSpan->firstPageOffset_ != span->firstPageOffset_) {
                         break;
                     }
+                    if (prevSpan->node_ != span->node_) {
+                        break;
+                    }
                     if (prevSpan->pageCount_ + span->pageCount_ >= MaxPageNum) {
                         break;
                     }
+                    merge(span, prevSpan);
                     span->firstPageId_ = prevSpan->firstPageId_;
                     span->pageCount_ += prevSpan->pageCount_;
-                    freeLists_[prevSpan->pageCount_].erase(prevSpan);
+                    freeLists_[span->node_][prevSpan->pageCount_].erase(prevSpan);
                     ObjectPool<Span>::getInstance().delete_(prevSpan);
                 }
                 while (true) {
@@ -493,19 +1349,90 @@ namespace mtmalloc {
                     if (nextSpan->firstPageOffset_ != span->firstPageOffset_) {
                         break;
                     }
+                    if (nextSpan->node_ != span->node_) {
+                        break;
+                    }
                     if (nextSpan->pageCount_ + span->pageCount_ >= MaxPageNum) {
                         break;
                     }
+                    merge(span, nextSpan);
                     span->pageCount_ += nextSpan->pageCount_;
-                    freeLists_[nextSpan->pageCount_].erase(nextSpan);
+                    freeLists_[span->node_][nextSpan->pageCount_].erase(nextSpan);
                     ObjectPool<Span>::getInstance().delete_(nextSpan);
                 }
 
+                auto isCold = span->isCold_;
                 span->isUsing_ = false;
-                freeLists_[span->pageCount_].push(span);
+                span->isCold_ = false;
+                freeLists_[span->node_][span->pageCount_].push(span);
                 PageMap<Bits>::getInstance().set(span->firstPageId_, span);
                 PageMap<Bits>::getInstance().set(span->firstPageId_ + span->pageCount_ - 1,
                     span);
+
+                if (isCold || SoftLimit::getInstance().approaching(0)) {
+                    release(span);
+                }
+                else if (settings.release_rate > 0) {
+                    scavenge(span->pageCount_);
+                }
+            }
+
+            // release free spans of every node, largest first, until the heap
+            // is at most target bytes
+            size_t releaseFreeSpans(size_t target) {
+                size_t res = 0;
+                for (auto i = MaxPageNum - 1; i > 0; --i) {
+                    for (auto& freeLists : freeLists_) {
+                        for (auto span = freeLists[i].begin(); span != freeLists[i].end();
+                            span = span->next_) {
+                            if (SoftLimit::heapBytes() <= target) {
+                                return res;
+                            }
+                            res += release(span);
+                        }
+                    }
+                }
+                return res;
+            }
+
+            // map bytes ahead of time as free spans of the largest class on the
+            // calling thread's node, return the bytes mapped
+            size_t reserve(size_t bytes, bool prefault) {
+                constexpr auto chunk = (MaxPageNum - 1) << PageShift;
+                auto node = Numa::getInstance().currentNode();
+
+                size_t res = 0;
+                while (res < bytes) {
+                    auto ptr = map(chunk, node, prefault);
+                    auto span = ObjectPool<Span>::getInstance().new_();
+                    span->firstPageId_ = Helper::addressToPageId(ptr);
+                    span->firstPageOffset_ = Helper::addressToPageOffset(ptr);
+                    span->pageCount_ = MaxPageNum - 1;
+                    span->node_ = static_cast<uint8_t>(node);
+                    freeLists_[node][span->pageCount_].push(span);
+                    PageMap<Bits>::getInstance().set(span->firstPageId_, span);
+                    PageMap<Bits>::getInstance().set(
+                        span->firstPageId_ + span->pageCount_ - 1, span);
+                    res += chunk;
+                }
+                return res;
+            }
+
+            // visit free spans and large object spans, holding the lock
+            template <typename F>
+            void walk(F&& visit) const {
+                for (const auto& freeLists : freeLists_) {
+                    for (size_t i = 1; i < MaxPageNum; ++i) {
+                        for (auto span = freeLists[i].begin(); span != freeLists[i].end();
+                            span = span->next_) {
+                            visit(span);
+                        }
+                    }
+                }
+                for (auto span = largeSpans_.begin(); span != largeSpans_.end();
+                    span = span->next_) {
+                    visit(span);
+                }
             }
 
             Span* findSpan(void* ptr) const {
@@ -516,40 +1443,181 @@ namespace mtmalloc {
             }
 
         private:
-            SpanList freeLists_[MaxPageNum]; // index is pageNum
+            // a node only takes spans of its own, it maps more memory rather
+            // than hand out another node's
+            Span* allocateSpan(size_t pageNum, size_t node) {
+                assert(pageNum > 0);
+
+                auto& freeLists = freeLists_[node];
+                if (pageNum >= MaxPageNum) {
+                    relieve(pageNum << PageShift);
+                    auto ptr = map(pageNum << PageShift, node);
+                    auto res = ObjectPool<Span>::getInstance().new_();
+                    res->firstPageId_ = Helper::addressToPageId(ptr);
+                    res->firstPageOffset_ = Helper::addressToPageOffset(ptr);
+                    res->pageCount_ = pageNum;
+                    res->node_ = static_cast<uint8_t>(node);
+                    for (size_t i = 0; i < res->pageCount_; i++) {
+                        PageMap<Bits>::getInstance().set(res->firstPageId_ + i, res);
+                    }
+                    return res;
+                }
+
+                if (!freeLists[pageNum].empty()) {
+                    auto res = freeLists[pageNum].pop();
+                    for (size_t i = 0; i < res->pageCount_; i++) {
+                        PageMap<Bits>::getInstance().set(res->firstPageId_ + i, res);
+                    }
+                    return res;
+                }
+
+                for (auto i = pageNum + 1; i < MaxPageNum; i++) {
+                    if (!freeLists[i].empty()) {
+                        auto t = freeLists[i].pop();
+
+                        auto res = ObjectPool<Span>::getInstance().new_();
+                        res->firstPageId_ = t->firstPageId_;
+                        res->firstPageOffset_ = t->firstPageOffset_;
+                        res->pageCount_ = pageNum;
+                        res->isReleased_ = t->isReleased_;
+                        res->node_ = t->node_;
+                        for (size_t j = 0; j < res->pageCount_; j++) {
+                            PageMap<Bits>::getInstance().set(res->firstPageId_ + j, res);
+                        }
+
+                        t->firstPageId_ += pageNum;
+                        t->pageCount_ -= pageNum;
+                        freeLists[t->pageCount_].push(t);
+                        PageMap<Bits>::getInstance().set(t->firstPageId_, t);
+                        PageMap<Bits>::getInstance().set(t->firstPageId_ + t->pageCount_ - 1,
+                            t);
+                        return res;
+                    }
+                }
+
+                // new a big Span
+                relieve((MaxPageNum - 1) << PageShift);
+                auto res = ObjectPool<Span>::getInstance().new_();
+                auto ptr = map((MaxPageNum - 1) << PageShift, node);
+                res->firstPageId_ = Helper::addressToPageId(ptr);
+                res->firstPageOffset_ = Helper::addressToPageOffset(ptr);
+                res->pageCount_ = MaxPageNum - 1;
+                res->node_ = static_cast<uint8_t>(node);
+                freeLists[res->pageCount_].push(res);
+                return allocateSpan(pageNum, node);
+            }
+
+            // the memory policy applies when a page is first touched, so with
+            // several nodes the pages are faulted in only after binding
+            static void* map(size_t bytes, size_t node, bool populate = false) {
+                auto& numa = Numa::getInstance();
+                if (numa.nodeCount() == 1) {
+                    return SysAlloc(bytes, populate);
+                }
+                auto res = SysAlloc(bytes);
+                numa.bind(res, bytes, node);
+                for (size_t i = 0; populate && i < bytes; i += size_t{ 1 } << SysPageShift) {
+                    static_cast<volatile char*>(res)[i] = 0;
+                }
+                return res;
+            }
+
+            size_t release(Span* span) {
+                if (span->isReleased_) {
+                    return 0;
+                }
+                auto bytes = span->pageCount_ << PageShift;
+                SysRelease(Helper::spanToBeginAddress(span), bytes);
+                releasedBytes.fetch_add(bytes, std::memory_order_relaxed);
+                span->isReleased_ = true;
+                return bytes;
+            }
+
+            // a span merged with a released neighbour stays released, so allocate
+            // commits it as a whole; until then its resident pages count as
+            // released, committing them again is harmless
+            static void merge(Span* span, const Span* neighbour) {
+                if (span->isReleased_ == neighbour->isReleased_) {
+                    return;
+                }
+                auto resident = span->isReleased_ ? neighbour : span;
+                releasedBytes.fetch_add(resident->pageCount_ << PageShift,
+                    std::memory_order_relaxed);
+                span->isReleased_ = true;
+            }
+
+            // as tcmalloc's release rate: after releasing n pages, wait for
+            // 1000 * n / release_rate pages to be freed before the next release
+            void scavenge(size_t pageNum) {
+                scavengeCountdown_ -= static_cast<double>(pageNum);
+                if (scavengeCountdown_ > 0) {
+                    return;
+                }
+
+                size_t released = 0;
+                for (auto i = MaxPageNum - 1; i > 0 && released == 0; --i) {
+                    for (auto& freeLists : freeLists_) {
+                        for (auto span = freeLists[i].begin();
+                            span != freeLists[i].end() && released == 0;
+                            span = span->next_) {
+                            released = release(span) >> PageShift;
+                        }
+                    }
+                }
+                scavengeCountdown_ = 1000.0 / settings.release_rate *
+                    static_cast<double>(std::max(released, size_t{ 1 }));
+            }
+
+            // called with mtx_ held before the heap grows by extra bytes
+            void relieve(size_t extra) {
+                auto& softLimit = SoftLimit::getInstance();
+                if (!softLimit.approaching(extra)) {
+                    return;
+                }
+
+                auto limit = softLimit.limit();
+                auto target = limit - limit / 8;
+                releaseFreeSpans(target > extra ? target - extra : 0);
+                // central cache returns a span to the page heap as soon as it is
+                // empty, so only thread caches hold on to free memory
+                flushEpoch.fetch_add(1, std::memory_order_relaxed);
+
+                if (softLimit.exceeded(extra)) {
+                    softLimit.markExceeded();
+                }
+            }
+
+            SpanList freeLists_[MaxNodeNum][MaxPageNum]; // index is node, pageNum
+            SpanList largeSpans_;            // in use by objects above the threshold
+            double scavengeCountdown_{};     // pages to free before the next release
             static constexpr size_t Bits = (sizeof(void*) == 8 ? 48 : 32) - PageShift;
 
         public:
-            mutable std::mutex mtx_;
+            mutable Mutex mtx_;
         };
 
         class MutexSpanList final : public SpanList {
         public:
             using SpanList::SpanList;
-            mutable std::mutex mtx_;
+            mutable Mutex mtx_;
         };
 
-        class CentralCache final : public Singleton<CentralCache> {
-            friend class Singleton<CentralCache>;
-            CentralCache() = default;
+        // cold memblocks are carved from spans of their own. Each node has its
+        // buckets: a thread takes memblocks from its current node and a
+        // memblock goes back to the node of its span
+        template <hint Hint>
+        class BasicCentralCache final : public Singleton<BasicCentralCache<Hint>> {
+            friend class Singleton<BasicCentralCache>;
+            BasicCentralCache() = default;
 
         public:
             auto allocate(size_t index, size_t batch, size_t size) const {
                 assert(index < MaxBucketNum);
 
-                std::lock_guard<std::mutex> bucketLock{ freeLists_[index].mtx_ };
-
-                auto span = freeLists_[index].begin();
-                while (span != freeLists_[index].end()) {
-                    if (span->freeList_) {
-                        break;
-                    }
-                    span = span->next_;
-                }
-                if (span == freeLists_[index].end()) {
-                    span = fetchFromPageCache(index, size);
-                }
+                auto node = Numa::getInstance().currentNode();
+                std::lock_guard<Mutex> bucketLock{ freeLists_[node][index].mtx_ };
 
+                auto span = spanWithMemblocks(node, index, size);
                 auto first = span->freeList_, last = first;
                 size_t cnt = 1;
                 while (cnt < batch && Helper::next(last)) {
@@ -563,54 +1631,120 @@ namespace mtmalloc {
                 return std::make_tuple(first, last, cnt);
             }
 
+            // write up to batch memblocks of one span to out, return how many
+            size_t allocate(size_t index, size_t batch, size_t size, void** out) const {
+                assert(index < MaxBucketNum);
+                assert(batch > 0);
+
+                auto node = Numa::getInstance().currentNode();
+                std::lock_guard<Mutex> bucketLock{ freeLists_[node][index].mtx_ };
+
+                auto span = spanWithMemblocks(node, index, size);
+                size_t cnt = 0;
+                auto cur = span->freeList_;
+                while (cnt < batch && cur) {
+                    out[cnt++] = cur;
+                    cur = Helper::next(cur);
+                }
+                span->freeList_ = cur;
+
+                span->useCount_ += static_cast<int>(cnt);
+                return cnt;
+            }
+
+            // return a chain of memblocks linked by Helper::next
             void deallocate(void* ptr, size_t size) const {
+                deallocateEach(size, [&ptr] {
+                    auto res = ptr;
+                    if (ptr) {
+                        ptr = Helper::next(ptr);
+                    }
+                    return res;
+                });
+            }
+
+            void deallocate(void* const* ptrs, size_t n, size_t size) const {
+                deallocateEach(size, [&ptrs, end = ptrs + n] {
+                    return ptrs != end ? *ptrs++ : nullptr;
+                });
+            }
+
+        private:
+            // next() yields the memblocks to return, then nullptr; it reads a
+            // memblock's link before the memblock is handed back
+            template <typename Next>
+            void deallocateEach(size_t size, Next next) const {
                 auto index = Helper::bytesToIndex(size);
                 assert(index < MaxBucketNum);
 
-                std::unique_lock<std::mutex> bucketLock{ freeLists_[index].mtx_ };
-                while (ptr) {
-                    auto next = Helper::next(ptr);
-
+                // one bucket lock at a time, switched when the node changes
+                std::unique_lock<Mutex> bucketLock;
+                const MutexSpanList* bucket{};
+                for (auto ptr = next(); ptr; ptr = next()) {
                     auto span = PageHeap::getInstance().findSpan(ptr);
+                    if (bucket != &freeLists_[span->node_][index]) {
+                        if (bucketLock.owns_lock()) {
+                            bucketLock.unlock();
+                        }
+                        bucket = &freeLists_[span->node_][index];
+                        bucketLock = std::unique_lock<Mutex>{ bucket->mtx_ };
+                    }
                     Helper::next(ptr) = span->freeList_;
                     span->freeList_ = ptr;
 
                     if (--span->useCount_ <= 0) {
-                        freeLists_[index].erase(span);
+                        bucket->erase(span);
                         span->freeList_ = nullptr;
                         span->next_ = nullptr;
                         span->prev_ = nullptr;
 
                         bucketLock.unlock();
                         {
-                            std::lock_guard<std::mutex> pageHeapLock{
+                            std::lock_guard<Mutex> pageHeapLock{
                                 PageHeap::getInstance().mtx_ };
                             PageHeap::getInstance().deallocate(span);
                         }
                         bucketLock.lock();
                     }
+                }
+            }
 
-                    ptr = next;
+            // called with the bucket lock held
+            Span* spanWithMemblocks(size_t node, size_t index, size_t size) const {
+                auto& bucket = freeLists_[node][index];
+                auto span = bucket.begin();
+                while (span != bucket.end()) {
+                    if (span->freeList_) {
+                        return span;
+                    }
+                    span = span->next_;
                 }
+                return fetchFromPageCache(node, index, size);
             }
 
-        private:
-            Span* fetchFromPageCache(size_t index, size_t size) const {
-                freeLists_[index].mtx_.unlock();
+            Span* fetchFromPageCache(size_t node, size_t index, size_t size) const {
+#if defined(MTMALLOC_LATENCY_STATS)
+                LatencyTimer timer{ latency_path::fetch_from_page_cache };
+#endif
+                auto& bucket = freeLists_[node][index];
+                bucket.mtx_.unlock();
 
                 assert(index < MaxBucketNum);
 
                 auto pageNum = Helper::sizeToPageNum(size);
-                std::unique_lock<std::mutex> pageHeapLock{ PageHeap::getInstance().mtx_ };
-                auto span = PageHeap::getInstance().allocate(pageNum);
+                std::unique_lock<Mutex> pageHeapLock{ PageHeap::getInstance().mtx_ };
+                auto span = PageHeap::getInstance().allocate(pageNum, node);
+                assert(span != nullptr);
+                // marked before the lock is dropped, or a neighbour being freed
+                // would merge the span while its memblocks are carved
+                span->isUsing_ = true;
+                span->isCold_ = Hint == hint::cold;
+                span->size_ = size;
                 pageHeapLock.unlock();
 
-                assert(span != nullptr);
                 auto begin = static_cast<char*>(Helper::spanToBeginAddress(span));
                 auto end = static_cast<char*>(Helper::spanToEndAddress(span));
                 assert(end - begin >= size);
-                span->isUsing_ = true;
-                span->size_ = size;
 
                 span->freeList_ = begin;
                 auto tail = begin;
@@ -623,28 +1757,116 @@ namespace mtmalloc {
                 Helper::next(tail) =
                     nullptr;  // lost [cur, end) but ok coz it's managed by span
 
-                freeLists_[index].mtx_.lock();
-                freeLists_[index].push(span);
+                bucket.mtx_.lock();
+                bucket.push(span);
                 return span;
             }
 
+        public:
+            // visit the spans of every bucket, holding that bucket's lock
+            template <typename F>
+            void walk(F&& visit) const {
+                for (const auto& freeLists : freeLists_) {
+                    for (size_t i = 0; i < MaxBucketNum; ++i) {
+                        std::lock_guard<Mutex> bucketLock{ freeLists[i].mtx_ };
+                        for (auto span = freeLists[i].begin(); span != freeLists[i].end();
+                            span = span->next_) {
+                            visit(span, i);
+                        }
+                    }
+                }
+            }
+
+            Mutex& bucketMutex(size_t index, size_t node = 0) const {
+                assert(index < MaxBucketNum && node < MaxNodeNum);
+                return freeLists_[node][index].mtx_;
+            }
+
         private:
-            MutexSpanList freeLists_[MaxBucketNum]; // index is size
+            MutexSpanList freeLists_[MaxNodeNum][MaxBucketNum]; // index is node, size
         };
 
-        // A special double-list for memblock
+        using CentralCache = BasicCentralCache<hint::hot>;
+        using ColdCentralCache = BasicCentralCache<hint::cold>;
+
+#if defined(MTMALLOC_ARRAY_TCLIST)
+
+        // A fixed-capacity stack of memblock pointers: free never writes to the
+        // memblock and moves to and from central cache copy pointer runs
         class TCList {
         public:
+            static constexpr size_t Capacity = 1024;
+
             void push(void* node) {
                 assert(node != nullptr);
+                assert(length_ < Capacity);
 
-                Helper::next(node) = dummy_;
-                dummy_ = node;
-                ++length_;
+                slots_[length_++] = node;
             }
 
-            void push(void* first, void* last, size_t n) {
-                assert(first != nullptr);
+            void* pop() {
+                assert(!empty());
+                return slots_[--length_];
+            }
+
+            // the n memblocks on top, valid until the next push
+            [[nodiscard]] void* const* top(size_t n) const {
+                assert(n <= length_);
+                return slots_ + (length_ - n);
+            }
+
+            void drop(size_t n) {
+                assert(n <= length_);
+                length_ -= n;
+            }
+
+            // room for space() memblocks, made part of the stack by grow
+            [[nodiscard]] void** end() { return slots_ + length_; }
+
+            [[nodiscard]] size_t space() const { return Capacity - length_; }
+
+            void grow(size_t n) {
+                assert(n <= space());
+                length_ += n;
+            }
+
+            [[nodiscard]] bool empty() const { return length_ == 0; }
+
+            [[nodiscard]] void* front() const { return slots_[length_ - 1]; }
+
+            [[nodiscard]] size_t length() const { return length_; }
+
+            [[nodiscard]] size_t maxLength() const { return maxLength_; }
+
+            // below Capacity, so a list at its max length can take one more push
+            void increaseMaxLength() { maxLength_ = std::min(maxLength_ + 1, Capacity - 1); }
+
+            void raiseMaxLength(size_t n) {
+                maxLength_ = std::max(maxLength_, std::min(n, Capacity - 1));
+            }
+
+        private:
+            size_t length_{};
+            size_t maxLength_{ 1 }; // for slow-start
+
+            void* slots_[Capacity]; // left uninitialized, see ThreadCache()
+        };
+
+#else
+
+        // A special double-list for memblock
+        class TCList {
+        public:
+            void push(void* node) {
+                assert(node != nullptr);
+
+                Helper::next(node) = dummy_;
+                dummy_ = node;
+                ++length_;
+            }
+
+            void push(void* first, void* last, size_t n) {
+                assert(first != nullptr);
                 assert(last != nullptr);
 
                 Helper::next(last) = dummy_;
@@ -670,12 +1892,16 @@ namespace mtmalloc {
 
             [[nodiscard]] bool empty() const { return length_ == 0; }
 
+            [[nodiscard]] void* front() const { return dummy_; }
+
             [[nodiscard]] size_t length() const { return length_; }
 
             [[nodiscard]] size_t maxLength() const { return maxLength_; }
 
             void increaseMaxLength() { ++maxLength_; }
 
+            void raiseMaxLength(size_t n) { maxLength_ = std::max(maxLength_, n); }
+
         private:
             void* dummy_{};
             size_t length_{};
@@ -683,17 +1909,35 @@ namespace mtmalloc {
             size_t maxLength_{ 1 }; // for slow-start
         };
 
+#endif
+
         class ThreadCache {
         public:
+            // user-provided, so ObjectPool's T{} does not zero the array bins
+            ThreadCache() {}
+
             void* allocate(size_t bytes) {
                 assert(bytes > 0 && bytes <= TCMaxSize);
 
                 auto size = Helper::bytesToSize(bytes);
                 auto index = Helper::bytesToIndex(bytes);
                 if (!freeLists_[index].empty()) {
+                    bytes_ -= size;
                     return freeLists_[index].pop();
                 }
-                return fetchFromCentralCache(index, size);
+                return fetchFromCentralCache(index, size, Helper::sizeToBatch(size));
+            }
+
+            // size class resolved at compile time, see malloc_fixed
+            template <size_t Index, size_t Size>
+            void* allocate() {
+                static_assert(Index < MaxBucketNum);
+
+                if (!freeLists_[Index].empty()) {
+                    bytes_ -= Size;
+                    return freeLists_[Index].pop();
+                }
+                return fetchFromCentralCache(Index, Size, Helper::sizeToBatch(Size));
             }
 
             void deallocate(void* ptr, size_t size) {
@@ -702,101 +1946,1553 @@ namespace mtmalloc {
 
                 auto index = Helper::bytesToIndex(size);
                 freeLists_[index].push(ptr);
+                bytes_ += size;
 
                 if (freeLists_[index].length() >= freeLists_[index].maxLength()) {
-                    auto first = freeLists_[index].pop(freeLists_[index].maxLength());
-                    CentralCache::getInstance().deallocate(first, size);
+                    release(freeLists_[index], freeLists_[index].maxLength(), size);
+                    flushIfRequested();
+                }
+                else if (overLimit()) {
+                    shrink();
+                }
+            }
+
+            template <size_t Index, size_t Size>
+            void deallocate(void* ptr) {
+                static_assert(Index < MaxBucketNum);
+                assert(ptr != nullptr);
+
+                freeLists_[Index].push(ptr);
+                bytes_ += Size;
+
+                if (freeLists_[Index].length() >= freeLists_[Index].maxLength()) {
+                    release(freeLists_[Index], freeLists_[Index].maxLength(), Size);
+                    flushIfRequested();
+                }
+                else if (overLimit()) {
+                    shrink();
+                }
+            }
+
+            // fill out with n memblocks of bytes, popping the free list and then
+            // taking whole runs from central cache
+            void allocateBatch(size_t bytes, size_t n, void** out) {
+                assert(bytes > 0 && bytes <= TCMaxSize);
+
+                auto size = Helper::bytesToSize(bytes);
+                auto index = Helper::bytesToIndex(bytes);
+                auto& list = freeLists_[index];
+
+                size_t filled = 0;
+                while (filled < n && !list.empty()) {
+                    out[filled++] = list.pop();
+                    bytes_ -= size;
+                }
+                if (filled == n) {
+                    return;
+                }
+
+                // a batch caller announces its working set, skip slow-start
+                flushIfRequested();
+                list.raiseMaxLength(std::min(n, Helper::sizeToBatch(size)));
+                while (filled < n) {
+                    filled += CentralCache::getInstance().allocate(
+                        index, n - filled, size, out + filled);
+                }
+                SoftLimit::getInstance().notify();
+            }
+
+            // take a chain of n memblocks of one size class, what exceeds the
+            // list's max length goes back to central cache in one call
+            void deallocateBatch(void* first, void* last, size_t n, size_t size) {
+                assert(first != nullptr);
+                assert(last != nullptr);
+                assert(size > 0 && size <= TCMaxSize);
+
+                auto index = Helper::bytesToIndex(size);
+                auto& list = freeLists_[index];
+                bytes_ += n * size;
+#if defined(MTMALLOC_ARRAY_TCLIST)
+                (void)last;
+                for (auto cur = first; n > 0; --n) {
+                    if (list.space() == 0) {
+                        release(list, list.length() / 2, size);
+                    }
+                    auto next = Helper::next(cur);
+                    list.push(cur);
+                    cur = next;
+                }
+#else
+                list.push(first, last, n);
+#endif
+
+                if (list.length() > list.maxLength()) {
+                    release(list, list.length() - list.maxLength(), size);
+                    flushIfRequested();
+                }
+                if (overLimit()) {
+                    shrink();
+                }
+            }
+
+            // fill the list of bytes' class up to count memblocks and keep it
+            // from flushing them back before they are used
+            void prewarm(size_t bytes, size_t count) {
+                assert(bytes > 0 && bytes <= TCMaxSize);
+
+                auto size = Helper::bytesToSize(bytes);
+                auto index = Helper::bytesToIndex(bytes);
+                auto& list = freeLists_[index];
+
+                list.raiseMaxLength(count + Helper::sizeToBatch(size));
+#if defined(MTMALLOC_ARRAY_TCLIST)
+                count = std::min(count, TCList::Capacity - 1);
+                while (list.length() < count) {
+                    auto cnt = CentralCache::getInstance().allocate(
+                        index, count - list.length(), size, list.end());
+                    list.grow(cnt);
+                    bytes_ += cnt * size;
+                }
+#else
+                while (list.length() < count) {
+                    auto [first, last, cnt] = CentralCache::getInstance().allocate(
+                        index, count - list.length(), size);
+                    list.push(first, last, cnt);
+                    bytes_ += cnt * size;
+                }
+#endif
+                SoftLimit::getInstance().notify();
+            }
+
+            // return every cached memblock to central cache
+            void flush() {
+                for (auto& list : freeLists_) {
+                    if (list.empty()) {
+                        continue;
+                    }
+                    auto size = PageHeap::getInstance().findSpan(list.front())->size_;
+                    release(list, list.length(), size);
                 }
             }
 
         private:
-            void* fetchFromCentralCache(size_t index, size_t size) {
+            [[nodiscard]] bool overLimit() const {
+                auto limit = settings.thread_cache_bytes;
+                return limit != 0 && bytes_ > limit;
+            }
+
+            // return half of every list, rounded up, to central cache
+            void shrink() {
+                for (auto& list : freeLists_) {
+                    if (list.empty()) {
+                        continue;
+                    }
+                    auto size = PageHeap::getInstance().findSpan(list.front())->size_;
+                    release(list, (list.length() + 1) / 2, size);
+                }
+            }
+
+            // return the n memblocks on top of list to central cache
+            void release(TCList& list, size_t n, size_t size) {
+                bytes_ -= n * size;
+#if defined(MTMALLOC_ARRAY_TCLIST)
+                CentralCache::getInstance().deallocate(list.top(n), n, size);
+                list.drop(n);
+#else
+                CentralCache::getInstance().deallocate(list.pop(n), size);
+#endif
+            }
+
+            void flushIfRequested() {
+                auto epoch = flushEpoch.load(std::memory_order_relaxed);
+                if (epoch != flushEpoch_) {
+                    flushEpoch_ = epoch;
+                    flush();
+                }
+            }
+
+            void* fetchFromCentralCache(size_t index, size_t size, size_t batch) {
                 assert(index < MaxBucketNum);
+#if defined(MTMALLOC_LATENCY_STATS)
+                LatencyTimer timer{ latency_path::fetch_from_central_cache };
+#endif
+                flushIfRequested();
 
-                // slow-start
-                auto batch = Helper::sizeToBatch(size);
-                if (batch >= freeLists_[index].maxLength()) {
+                if (!settings.slow_start) {
+                    freeLists_[index].raiseMaxLength(batch + 1);
+                }
+                else if (batch >= freeLists_[index].maxLength()) {
                     batch = freeLists_[index].maxLength();
                     freeLists_[index].increaseMaxLength();
                 }
 
+#if defined(MTMALLOC_ARRAY_TCLIST)
+                auto& list = freeLists_[index];
+                auto cnt = CentralCache::getInstance().allocate(
+                    index, std::min(batch, list.space()), size, list.end());
+                list.grow(cnt);
+                bytes_ += (cnt - 1) * size;
+                auto first = list.pop();
+#else
                 auto [first, last, cnt] =
                     CentralCache::getInstance().allocate(index, batch, size);
                 if (cnt > 1) {
                     freeLists_[index].push(Helper::next(first), last, cnt - 1);
+                    bytes_ += (cnt - 1) * size;
                 }
+#endif
+
+                SoftLimit::getInstance().notify();
                 return first;
             }
 
         private:
             TCList freeLists_[MaxBucketNum]; // index is size
+            size_t bytes_{};                 // cached in freeLists_
+            uint64_t flushEpoch_{};
         };
 
         inline thread_local ThreadCache* tc{};
 
-    }  // namespace detail
+        inline ThreadCache* threadCache() {
+            if (tc == nullptr) {
+                tc = ObjectPool<ThreadCache>::getInstance().new_();
+            }
+            return tc;
+        }
 
-    /*
-     * C-Style API
-     */
+        // frees memblocks handed over by free_deferred on a background thread
+        class Reclaimer final : public Singleton<Reclaimer> {
+            friend class Singleton<Reclaimer>;
+            Reclaimer() = default;
 
-    inline void* malloc(size_t bytes) {
-        if (bytes == 0) {
-            return {};
-        }
+        public:
+            ~Reclaimer() {
+                {
+                    std::lock_guard<std::mutex> lock{ mtx_ };
+                    stopping_ = true;
+                    cv_.notify_one();
+                }
+                if (worker_.joinable()) {
+                    worker_.join();
+                }
+                reclaim(pending_);
+            }
 
-        using namespace detail;
+            // hand over a chain of memblocks linked by Helper::next
+            void push(void* first, void* last) {
+                assert(first != nullptr);
+                assert(last != nullptr);
 
-        if (bytes > TCMaxSize) {
-            // allocate from page heap
-            auto size = Helper::bytesToSize(bytes);
-            auto pageNum = Helper::sizeToPageNum(size);
-            std::lock_guard<std::mutex> pageHeapLock{ PageHeap::getInstance().mtx_ };
-            auto span = PageHeap::getInstance().allocate(pageNum);
-            span->size_ = size;
-            return Helper::spanToBeginAddress(span);
-        }
+                std::lock_guard<std::mutex> lock{ mtx_ };
+                // a busy worker or one already woken will see the chain anyway
+                auto wake = pending_ == nullptr && !busy_;
+                Helper::next(last) = pending_;
+                pending_ = first;
+                if (!worker_.joinable()) {
+                    worker_ = std::thread{ [this] { run(); } };
+                }
+                if (wake) {
+                    cv_.notify_one();
+                }
+            }
 
-        // allocate from thread cache
-        if (tc == nullptr) {
-            tc = ObjectPool<ThreadCache>::getInstance().new_();
-        }
-        return tc->allocate(bytes);
-    }
+            // block until everything pushed so far has been freed
+            void wait() {
+                std::unique_lock<std::mutex> lock{ mtx_ };
+                idle_.wait(lock, [this] { return pending_ == nullptr && !busy_; });
+            }
 
-    inline void* calloc(size_t num, size_t bytes) {
-        auto total = num * bytes;
-        auto res = malloc(total);
-        if (res) {
-            memset(res, 0, total);
-        }
-        return res;
-    }
+        private:
+            void run() {
+                std::unique_lock<std::mutex> lock{ mtx_ };
+                while (true) {
+                    cv_.wait(lock, [this] { return pending_ != nullptr || stopping_; });
+                    if (pending_ == nullptr) {
+                        return;
+                    }
 
-    inline void free(void* ptr) {
-        if (ptr == nullptr) {
-            return;
-        }
+                    auto chain = pending_;
+                    pending_ = nullptr;
+                    busy_ = true;
+                    lock.unlock();
 
-        using namespace detail;
-        auto span = PageHeap::getInstance().findSpan(ptr);
-        auto size = span->size_;
+                    reclaim(chain);
 
-        if (size > TCMaxSize) {
-            // deallocate to page heap
-            std::lock_guard<std::mutex> pageHeapLock{ PageHeap::getInstance().mtx_ };
-            PageHeap::getInstance().deallocate(span);
-        }
-        else {
-            // deallocate to thread cache
-            tc->deallocate(ptr, size);
-        }
-    }
+                    lock.lock();
+                    busy_ = false;
+                    idle_.notify_all();
+                }
+            }
 
-    inline void* realloc(void* ptr, size_t new_bytes) {
-        free(ptr);
-        return malloc(new_bytes);
-    }
+            // sort the chain by size class and return each class to central cache
+            // with a single call, large memblocks go straight to the page heap
+            static void reclaim(void* chain) {
+                void* lists[MaxBucketNum]{};
+                void* coldLists[MaxBucketNum]{};
+                size_t sizes[MaxBucketNum]{};
+
+                while (chain) {
+                    auto next = Helper::next(chain);
+
+                    auto span = PageHeap::getInstance().findSpan(chain);
+                    auto size = span->size_;
+                    if (size > settings.large_threshold) {
+                        std::lock_guard<Mutex> pageHeapLock{ PageHeap::getInstance().mtx_ };
+                        PageHeap::getInstance().deallocate(span);
+                    }
+                    else {
+                        auto index = Helper::bytesToIndex(size);
+                        auto& list = span->isCold_ ? coldLists[index] : lists[index];
+                        Helper::next(chain) = list;
+                        list = chain;
+                        sizes[index] = size;
+                    }
+
+                    chain = next;
+                }
+
+                for (size_t i = 0; i < MaxBucketNum; ++i) {
+                    if (lists[i] != nullptr) {
+                        CentralCache::getInstance().deallocate(lists[i], sizes[i]);
+                    }
+                    if (coldLists[i] != nullptr) {
+                        ColdCentralCache::getInstance().deallocate(coldLists[i], sizes[i]);
+                    }
+                }
+            }
+
+        private:
+            std::mutex mtx_;
+            std::condition_variable cv_;
+            std::condition_variable idle_;
+            std::thread worker_;
+            void* pending_{};
+            bool busy_{};
+            bool stopping_{};
+        };
+
+        // memblocks passed to free_deferred by this thread, not yet handed over
+        class DeferredBatch final : public ThreadLocalSingleton<DeferredBatch> {
+            friend class ThreadLocalSingleton<DeferredBatch>;
+            DeferredBatch() = default;
+
+        public:
+            static constexpr size_t MaxLength = 256;
+
+            ~DeferredBatch() { flush(); }
+
+            void push(void* ptr) {
+                assert(ptr != nullptr);
+
+                Helper::next(ptr) = first_;
+                if (first_ == nullptr) {
+                    last_ = ptr;
+                }
+                first_ = ptr;
+                if (++length_ >= MaxLength) {
+                    flush();
+                }
+            }
+
+            void flush() {
+                if (first_ == nullptr) {
+                    return;
+                }
+                Reclaimer::getInstance().push(first_, last_);
+                first_ = last_ = nullptr;
+                length_ = 0;
+            }
+
+        private:
+            void* first_{};
+            void* last_{};
+            size_t length_{};
+        };
+
+#if defined(MTMALLOC_TRACE)
+
+        // records are appended to per-thread chunks, full chunks are handed to
+        // a background writer, so the traced thread never touches the file
+        struct TraceChunk {
+            static constexpr size_t Capacity = 4096;
+
+            TraceChunk* next_{};
+            size_t count_{};
+            trace_record records_[Capacity];
+        };
+
+        class TraceBuffer;
+
+        class Tracer final : public Singleton<Tracer> {
+            friend class Singleton<Tracer>;
+            Tracer() = default;
+
+        public:
+            ~Tracer() { stop(); }
+
+            bool start(const char* path) {
+                std::lock_guard<std::mutex> controlLock{ controlMtx_ };
+                if (file_ != nullptr) {
+                    return false;
+                }
+                auto file = std::fopen(path, "wb");
+                if (file == nullptr) {
+                    return false;
+                }
+                discardPending();
+
+                std::lock_guard<std::mutex> lock{ mtx_ };
+                file_ = file;
+
+                trace_header header{};
+                std::memcpy(header.magic, trace_magic, sizeof(trace_magic));
+                header.version = trace_version;
+                header.record_size = sizeof(trace_record);
+                std::fwrite(&header, sizeof(header), 1, file_);
+
+                stopping_ = false;
+                seq_.store(0, std::memory_order_relaxed);
+                start_ = std::chrono::steady_clock::now();
+                writer_ = std::thread{ [this] { writeLoop(); } };
+                enabled_.store(true, std::memory_order_release);
+                return true;
+            }
+
+            // flush every thread's pending records and close the file
+            void stop();
+
+            [[nodiscard]] bool enabled() const {
+                return enabled_.load(std::memory_order_acquire);
+            }
+
+            uint64_t nextSeq() { return seq_.fetch_add(1, std::memory_order_relaxed); }
+
+            uint64_t elapsed() const {
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start_).count();
+            }
+
+            uint32_t nextThreadId() {
+                return threadId_.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            TraceChunk* acquireChunk() {
+                {
+                    std::lock_guard<std::mutex> lock{ mtx_ };
+                    if (spare_ != nullptr) {
+                        auto res = spare_;
+                        spare_ = res->next_;
+                        res->next_ = nullptr;
+                        res->count_ = 0;
+                        return res;
+                    }
+                }
+                return new (SysAlloc(sizeof(TraceChunk))) TraceChunk{};
+            }
+
+            void submit(TraceChunk* chunk) {
+                assert(chunk != nullptr);
+
+                std::lock_guard<std::mutex> lock{ mtx_ };
+                pushFull(chunk);
+                cv_.notify_one();
+            }
+
+            void attach(TraceBuffer* buffer);
+            void detach(TraceBuffer* buffer);
+
+        private:
+            // drop records that raced with the previous trace_stop
+            void discardPending();
+
+            void pushFull(TraceChunk* chunk) {
+                chunk->next_ = nullptr;
+                if (fullTail_ != nullptr) {
+                    fullTail_->next_ = chunk;
+                }
+                else {
+                    fullHead_ = chunk;
+                }
+                fullTail_ = chunk;
+            }
+
+            void writeLoop() {
+                std::unique_lock<std::mutex> lock{ mtx_ };
+                while (true) {
+                    cv_.wait(lock, [this] { return fullHead_ != nullptr || stopping_; });
+
+                    auto chunk = fullHead_;
+                    fullHead_ = fullTail_ = nullptr;
+                    auto stopping = stopping_;
+                    lock.unlock();
+
+                    for (auto cur = chunk; cur != nullptr; cur = cur->next_) {
+                        std::fwrite(cur->records_, sizeof(trace_record), cur->count_, file_);
+                    }
+
+                    lock.lock();
+                    while (chunk != nullptr) {
+                        auto next = chunk->next_;
+                        chunk->next_ = spare_;
+                        spare_ = chunk;
+                        chunk = next;
+                    }
+                    if (stopping && fullHead_ == nullptr) {
+                        return;
+                    }
+                }
+            }
+
+        private:
+            std::atomic<bool> enabled_{};
+            std::atomic<uint64_t> seq_{};
+            std::atomic<uint32_t> threadId_{};
+            std::chrono::steady_clock::time_point start_{};
+
+            // lock order: controlMtx_, buffersMtx_, TraceBuffer::mtx_, mtx_
+            std::mutex controlMtx_;
+            std::mutex buffersMtx_;
+            TraceBuffer* buffers_{};  // every live thread's buffer
+
+            std::mutex mtx_;
+            std::condition_variable cv_;
+            TraceChunk* fullHead_{};
+            TraceChunk* fullTail_{};
+            TraceChunk* spare_{};
+            std::thread writer_;
+            std::FILE* file_{};
+            bool stopping_{};
+        };
+
+        class TraceBuffer final : public ThreadLocalSingleton<TraceBuffer> {
+            friend class ThreadLocalSingleton<TraceBuffer>;
+            friend class Tracer;
+
+            TraceBuffer() { Tracer::getInstance().attach(this); }
+
+        public:
+            ~TraceBuffer() {
+                Tracer::getInstance().detach(this);
+                std::lock_guard<std::mutex> lock{ mtx_ };
+                if (chunk_ != nullptr && chunk_->count_ > 0) {
+                    Tracer::getInstance().submit(chunk_);
+                    chunk_ = nullptr;
+                }
+            }
+
+            void append(trace_op op, void* ptr, void* oldPtr, size_t size) {
+                auto& tracer = Tracer::getInstance();
+
+                // the lock is only contended while trace_stop steals the chunk
+                std::lock_guard<std::mutex> lock{ mtx_ };
+                if (chunk_ == nullptr) {
+                    chunk_ = tracer.acquireChunk();
+                }
+
+                auto& record = chunk_->records_[chunk_->count_++];
+                record.seq = tracer.nextSeq();
+                record.timestamp = tracer.elapsed();
+                record.ptr = reinterpret_cast<uintptr_t>(ptr);
+                record.old_ptr = reinterpret_cast<uintptr_t>(oldPtr);
+                record.size = size;
+                record.thread = threadId_;
+                record.op = op;
+
+                if (chunk_->count_ == TraceChunk::Capacity) {
+                    tracer.submit(chunk_);
+                    chunk_ = nullptr;
+                }
+            }
+
+        private:
+            std::mutex mtx_;
+            TraceChunk* chunk_{};
+            uint32_t threadId_{ Tracer::getInstance().nextThreadId() };
+
+            TraceBuffer* next_{};
+            TraceBuffer* prev_{};
+        };
+
+        inline void Tracer::attach(TraceBuffer* buffer) {
+            std::lock_guard<std::mutex> lock{ buffersMtx_ };
+            buffer->next_ = buffers_;
+            if (buffers_ != nullptr) {
+                buffers_->prev_ = buffer;
+            }
+            buffers_ = buffer;
+        }
+
+        inline void Tracer::detach(TraceBuffer* buffer) {
+            std::lock_guard<std::mutex> lock{ buffersMtx_ };
+            if (buffer->prev_ != nullptr) {
+                buffer->prev_->next_ = buffer->next_;
+            }
+            else {
+                buffers_ = buffer->next_;
+            }
+            if (buffer->next_ != nullptr) {
+                buffer->next_->prev_ = buffer->prev_;
+            }
+        }
+
+        inline void Tracer::discardPending() {
+            std::lock_guard<std::mutex> buffersLock{ buffersMtx_ };
+            for (auto buffer = buffers_; buffer != nullptr; buffer = buffer->next_) {
+                std::lock_guard<std::mutex> bufferLock{ buffer->mtx_ };
+                if (buffer->chunk_ != nullptr) {
+                    buffer->chunk_->count_ = 0;
+                }
+            }
+        }
+
+        inline void Tracer::stop() {
+            std::lock_guard<std::mutex> controlLock{ controlMtx_ };
+            if (file_ == nullptr) {
+                return;
+            }
+            enabled_.store(false, std::memory_order_release);
+
+            {
+                std::lock_guard<std::mutex> buffersLock{ buffersMtx_ };
+                for (auto buffer = buffers_; buffer != nullptr; buffer = buffer->next_) {
+                    std::lock_guard<std::mutex> bufferLock{ buffer->mtx_ };
+                    if (buffer->chunk_ != nullptr && buffer->chunk_->count_ > 0) {
+                        submit(buffer->chunk_);
+                        buffer->chunk_ = nullptr;
+                    }
+                }
+            }
+
+            {
+                std::lock_guard<std::mutex> lock{ mtx_ };
+                stopping_ = true;
+                cv_.notify_one();
+            }
+            writer_.join();
+
+            std::lock_guard<std::mutex> lock{ mtx_ };
+            std::fclose(file_);
+            file_ = nullptr;
+        }
+
+        // realloc records itself once instead of as a free plus a malloc
+        inline thread_local bool traceSuspended{};
+
+        // suspends tracing for its scope, also when the malloc throws
+        class TraceSuspender final {
+        public:
+            TraceSuspender() noexcept { traceSuspended = true; }
+            ~TraceSuspender() { traceSuspended = false; }
+
+            TraceSuspender(const TraceSuspender&) = delete;
+            TraceSuspender& operator=(const TraceSuspender&) = delete;
+        };
+
+        inline void traceRecord(trace_op op, void* ptr, void* oldPtr, size_t size) {
+            if (traceSuspended || !Tracer::getInstance().enabled()) {
+                return;
+            }
+            TraceBuffer::getInstance().append(op, ptr, oldPtr, size);
+        }
+
+#endif
+
+#if defined(MTMALLOC_TAGS)
+
+        inline thread_local tag_t currentTag{};
+
+        // mean bytes allocated between two sampled memblocks
+        constexpr double TagSampleInterval = 64 * 1024;
+
+        class TagCounters;
+
+        // aggregates the per-thread counters and keeps the sampled memblocks;
+        // a sample stands for 1 / p memblocks of its size, where p is the
+        // chance that a memblock of that size is sampled
+        class Tagger final : public Singleton<Tagger> {
+            friend class Singleton<Tagger>;
+            Tagger() = default;
+
+        public:
+            void attach(TagCounters* counters);
+
+            // fold the exiting thread's counters into the retired totals
+            void detach(TagCounters* counters);
+
+            tag_stats usage(tag_t tag);
+
+            void addLarge(tag_t tag, size_t size) {
+                std::lock_guard<std::mutex> lock{ mtx_ };
+                liveBytes_[tag] += static_cast<double>(size);
+                liveObjects_[tag] += 1;
+            }
+
+            void removeLarge(tag_t tag, size_t size) {
+                std::lock_guard<std::mutex> lock{ mtx_ };
+                liveBytes_[tag] -= static_cast<double>(size);
+                liveObjects_[tag] -= 1;
+            }
+
+            void addSample(Span* span, void* ptr, tag_t tag, size_t size) {
+                auto p = -std::expm1(-static_cast<double>(size) / TagSampleInterval);
+                Sample sample{ tag, static_cast<double>(size) / p, 1 / p };
+
+                std::lock_guard<std::mutex> lock{ mtx_ };
+                samples_.emplace(ptr, sample);
+                span->samples_.fetch_add(1, std::memory_order_relaxed);
+                liveBytes_[tag] += sample.bytes;
+                liveObjects_[tag] += sample.objects;
+            }
+
+            void removeSample(Span* span, void* ptr) {
+                std::lock_guard<std::mutex> lock{ mtx_ };
+                auto it = samples_.find(ptr);
+                if (it == samples_.end()) {
+                    return;
+                }
+                liveBytes_[it->second.tag] -= it->second.bytes;
+                liveObjects_[it->second.tag] -= it->second.objects;
+                span->samples_.fetch_sub(1, std::memory_order_relaxed);
+                samples_.erase(it);
+            }
+
+        private:
+            struct Sample {
+                tag_t tag;
+                double bytes;
+                double objects;
+            };
+
+            std::mutex mtx_;
+            TagCounters* counters_{};  // intrusive list of live threads
+            uint64_t retiredBytes_[tag_num]{};
+            uint64_t retiredObjects_[tag_num]{};
+            double liveBytes_[tag_num]{};
+            double liveObjects_[tag_num]{};
+            std::unordered_map<void*, Sample> samples_;
+        };
+
+        // allocation counters of one thread, only read by other threads
+        class TagCounters final : public ThreadLocalSingleton<TagCounters> {
+            friend class ThreadLocalSingleton<TagCounters>;
+            friend class Tagger;
+
+            TagCounters() {
+                untilSample_ = nextInterval();
+                Tagger::getInstance().attach(this);
+            }
+
+        public:
+            ~TagCounters() { Tagger::getInstance().detach(this); }
+
+            void add(tag_t tag, size_t size) {
+                // one writer, a plain load and store is enough
+                bytes_[tag].store(bytes_[tag].load(std::memory_order_relaxed) + size,
+                    std::memory_order_relaxed);
+                objects_[tag].store(objects_[tag].load(std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
+            }
+
+            // whether this memblock should be sampled
+            bool sample(size_t size) {
+                untilSample_ -= static_cast<double>(size);
+                if (untilSample_ > 0) {
+                    return false;
+                }
+                untilSample_ = nextInterval();
+                return true;
+            }
+
+        private:
+            // exponential intervals make every byte equally likely to be sampled
+            double nextInterval() {
+                rng_ ^= rng_ << 13;
+                rng_ ^= rng_ >> 7;
+                rng_ ^= rng_ << 17;
+                auto u = static_cast<double>((rng_ >> 11) + 1) * 0x1.0p-53;
+                return -std::log(u) * TagSampleInterval;
+            }
+
+            std::atomic<uint64_t> bytes_[tag_num]{};
+            std::atomic<uint64_t> objects_[tag_num]{};
+            double untilSample_{};
+            uint64_t rng_{ reinterpret_cast<uintptr_t>(this) | 1 };
+
+            TagCounters* next_{};
+            TagCounters* prev_{};
+        };
+
+        inline void Tagger::attach(TagCounters* counters) {
+            std::lock_guard<std::mutex> lock{ mtx_ };
+            counters->next_ = counters_;
+            if (counters_ != nullptr) {
+                counters_->prev_ = counters;
+            }
+            counters_ = counters;
+        }
+
+        inline void Tagger::detach(TagCounters* counters) {
+            std::lock_guard<std::mutex> lock{ mtx_ };
+            for (size_t i = 0; i < tag_num; ++i) {
+                retiredBytes_[i] += counters->bytes_[i].load(std::memory_order_relaxed);
+                retiredObjects_[i] += counters->objects_[i].load(std::memory_order_relaxed);
+            }
+            if (counters->prev_ != nullptr) {
+                counters->prev_->next_ = counters->next_;
+            }
+            else {
+                counters_ = counters->next_;
+            }
+            if (counters->next_ != nullptr) {
+                counters->next_->prev_ = counters->prev_;
+            }
+        }
+
+        inline tag_stats Tagger::usage(tag_t tag) {
+            std::lock_guard<std::mutex> lock{ mtx_ };
+            tag_stats res{ retiredBytes_[tag], retiredObjects_[tag], 0, 0 };
+            for (auto cur = counters_; cur != nullptr; cur = cur->next_) {
+                res.allocated_bytes += cur->bytes_[tag].load(std::memory_order_relaxed);
+                res.allocated_objects += cur->objects_[tag].load(std::memory_order_relaxed);
+            }
+            res.live_bytes = static_cast<uint64_t>(std::max(liveBytes_[tag], 0.0) + 0.5);
+            res.live_objects = static_cast<uint64_t>(std::max(liveObjects_[tag], 0.0) + 0.5);
+            return res;
+        }
+
+        // account a memblock to the current tag of this thread
+        inline void tagAllocate(void* ptr, size_t bytes) {
+            auto tag = currentTag;
+            auto& counters = TagCounters::getInstance();
+            if (bytes > settings.large_threshold) {
+                auto span = PageHeap::getInstance().findSpan(ptr);
+                span->tag_ = tag;
+                counters.add(tag, span->size_);
+                Tagger::getInstance().addLarge(tag, span->size_);
+            }
+            else {
+                auto size = Helper::bytesToSize(bytes);
+                counters.add(tag, size);
+                if (counters.sample(size)) {
+                    auto span = PageHeap::getInstance().findSpan(ptr);
+                    Tagger::getInstance().addSample(span, ptr, tag, size);
+                }
+            }
+        }
+
+        // must run before the memblock can be handed out again
+        inline void tagDeallocate(Span* span, void* ptr) {
+            if (span->size_ > settings.large_threshold) {
+                Tagger::getInstance().removeLarge(span->tag_, span->size_);
+            }
+            else if (span->samples_.load(std::memory_order_relaxed) != 0) {
+                Tagger::getInstance().removeSample(span, ptr);
+            }
+        }
+
+#endif
+
+    }  // namespace detail
+
+    /*
+     * C-Style API
+     */
+
+    inline void* malloc(size_t bytes) {
+        if (bytes == 0) {
+            return {};
+        }
+
+        using namespace detail;
+
+        void* res{};
+        if (bytes > settings.large_threshold) {
+            // allocate from page heap
+            auto size = Helper::bytesToSize(bytes);
+            auto pageNum = Helper::largeToPageNum(size);
+            {
+                std::lock_guard<Mutex> pageHeapLock{ PageHeap::getInstance().mtx_ };
+                auto span = PageHeap::getInstance().allocateLarge(pageNum, size);
+                res = Helper::spanToBeginAddress(span);
+            }
+            SoftLimit::getInstance().notify();
+        }
+        else {
+            // allocate from thread cache
+            res = threadCache()->allocate(bytes);
+        }
+
+#if defined(MTMALLOC_TAGS)
+        tagAllocate(res, bytes);
+#endif
+#if defined(MTMALLOC_TRACE)
+        traceRecord(trace_op::malloc, res, nullptr, bytes);
+#endif
+        return res;
+    }
+
+    inline void* calloc(size_t num, size_t bytes) {
+        auto total = num * bytes;
+        auto res = malloc(total);
+        if (res) {
+            memset(res, 0, total);
+        }
+        return res;
+    }
+
+    inline void free(void* ptr) {
+        if (ptr == nullptr) {
+            return;
+        }
+
+        using namespace detail;
+
+#if defined(MTMALLOC_TRACE)
+        traceRecord(trace_op::free, ptr, nullptr, 0);
+#endif
+
+        auto span = PageHeap::getInstance().findSpan(ptr);
+        auto size = span->size_;
+#if defined(MTMALLOC_TAGS)
+        tagDeallocate(span, ptr);
+#endif
+
+        if (size > settings.large_threshold) {
+            // deallocate to page heap
+            std::lock_guard<Mutex> pageHeapLock{ PageHeap::getInstance().mtx_ };
+            PageHeap::getInstance().deallocate(span);
+        }
+        else if (span->isCold_) {
+            // cold memblocks bypass the thread cache
+            Helper::next(ptr) = nullptr;
+            ColdCentralCache::getInstance().deallocate(ptr, size);
+        }
+        else {
+            // deallocate to thread cache
+            threadCache()->deallocate(ptr, size);
+        }
+    }
+
+    // allocate with a hint on how often the memory will be touched; cold
+    // memblocks skip the thread cache and come from cold spans
+    inline void* malloc_hint(size_t bytes, hint h) {
+        if (h == hint::hot || bytes == 0) {
+            return malloc(bytes);
+        }
+
+        using namespace detail;
+
+        void* res{};
+        if (bytes > settings.large_threshold) {
+            auto size = Helper::bytesToSize(bytes);
+            auto pageNum = Helper::largeToPageNum(size);
+            {
+                std::lock_guard<Mutex> pageHeapLock{ PageHeap::getInstance().mtx_ };
+                auto span = PageHeap::getInstance().allocateLarge(pageNum, size);
+                span->isCold_ = true;
+                res = Helper::spanToBeginAddress(span);
+            }
+        }
+        else {
+            auto size = Helper::bytesToSize(bytes);
+            auto index = Helper::bytesToIndex(bytes);
+            res = std::get<0>(ColdCentralCache::getInstance().allocate(index, 1, size));
+        }
+        SoftLimit::getInstance().notify();
+
+#if defined(MTMALLOC_TAGS)
+        tagAllocate(res, bytes);
+#endif
+#if defined(MTMALLOC_TRACE)
+        traceRecord(trace_op::malloc, res, nullptr, bytes);
+#endif
+        return res;
+    }
+
+    // malloc with the size class of Bytes resolved at compile time
+    template <size_t Bytes>
+    inline void* malloc_fixed() {
+        using namespace detail;
+
+        if constexpr (Bytes == 0 || Bytes > TCMaxSize) {
+            return malloc(Bytes);
+        }
+        else {
+            constexpr auto size = Helper::bytesToSize(Bytes);
+            constexpr auto index = Helper::bytesToIndex(Bytes);
+
+            if (Bytes > settings.large_threshold) {
+                return malloc(Bytes);
+            }
+            auto res = threadCache()->allocate<index, size>();
+#if defined(MTMALLOC_TAGS)
+            tagAllocate(res, Bytes);
+#endif
+#if defined(MTMALLOC_TRACE)
+            traceRecord(trace_op::malloc, res, nullptr, Bytes);
+#endif
+            return res;
+        }
+    }
+
+    // free a memblock from malloc_fixed<Bytes>, no page map lookup is needed
+    // as the size class is known
+    template <size_t Bytes>
+    inline void free_fixed(void* ptr) {
+        using namespace detail;
+
+        if constexpr (Bytes == 0 || Bytes > TCMaxSize) {
+            free(ptr);
+        }
+        else {
+            constexpr auto size = Helper::bytesToSize(Bytes);
+            constexpr auto index = Helper::bytesToIndex(Bytes);
+
+            if (Bytes > settings.large_threshold) {
+                free(ptr);
+                return;
+            }
+            if (ptr == nullptr) {
+                return;
+            }
+            assert(PageHeap::getInstance().findSpan(ptr)->size_ == size);
+            assert(!PageHeap::getInstance().findSpan(ptr)->isCold_);
+
+#if defined(MTMALLOC_TAGS)
+            tagDeallocate(PageHeap::getInstance().findSpan(ptr), ptr);
+#endif
+#if defined(MTMALLOC_TRACE)
+            traceRecord(trace_op::free, ptr, nullptr, 0);
+#endif
+            threadCache()->deallocate<index, size>(ptr);
+        }
+    }
+
+    // allocate n memblocks of bytes into out, return how many were allocated;
+    // chains move between the thread cache and central cache as a whole, so
+    // locking is paid once per span instead of once per memblock
+    inline size_t malloc_batch(size_t bytes, size_t n, void** out) {
+        if (bytes == 0 || n == 0) {
+            return 0;
+        }
+
+        using namespace detail;
+
+        if (bytes > settings.large_threshold) {
+            for (size_t i = 0; i < n; ++i) {
+                out[i] = malloc(bytes);
+            }
+            return n;
+        }
+
+        threadCache()->allocateBatch(bytes, n, out);
+
+#if defined(MTMALLOC_TAGS)
+        for (size_t i = 0; i < n; ++i) {
+            tagAllocate(out[i], bytes);
+        }
+#endif
+#if defined(MTMALLOC_TRACE)
+        for (size_t i = 0; i < n; ++i) {
+            traceRecord(trace_op::malloc, out[i], nullptr, bytes);
+        }
+#endif
+        return n;
+    }
+
+    // free n memblocks, consecutive memblocks of one size class are linked
+    // and pushed to the thread cache as a single chain
+    inline void free_batch(void** ptrs, size_t n) {
+        using namespace detail;
+
+        void* first{};
+        void* last{};
+        size_t count = 0;
+        size_t size = 0;
+
+        for (size_t i = 0; i < n; ++i) {
+            auto ptr = ptrs[i];
+            if (ptr == nullptr) {
+                continue;
+            }
+
+            auto span = PageHeap::getInstance().findSpan(ptr);
+            if (span->size_ > settings.large_threshold || span->isCold_) {
+                free(ptr);
+                continue;
+            }
+
+#if defined(MTMALLOC_TAGS)
+            tagDeallocate(span, ptr);
+#endif
+#if defined(MTMALLOC_TRACE)
+            traceRecord(trace_op::free, ptr, nullptr, 0);
+#endif
+
+            if (count > 0 && span->size_ != size) {
+                threadCache()->deallocateBatch(first, last, count, size);
+                count = 0;
+            }
+            if (count == 0) {
+                first = ptr;
+                size = span->size_;
+            }
+            else {
+                Helper::next(last) = ptr;
+            }
+            last = ptr;
+            ++count;
+        }
+
+        if (count > 0) {
+            threadCache()->deallocateBatch(first, last, count, size);
+        }
+    }
+
+    // queue ptr to be freed on a background thread, which returns whole
+    // batches to central cache and page heap
+    inline void free_deferred(void* ptr) {
+        if (ptr == nullptr) {
+            return;
+        }
+
+        using namespace detail;
+
+#if defined(MTMALLOC_TAGS)
+        tagDeallocate(PageHeap::getInstance().findSpan(ptr), ptr);
+#endif
+#if defined(MTMALLOC_TRACE)
+        traceRecord(trace_op::free, ptr, nullptr, 0);
+#endif
+
+        DeferredBatch::getInstance().push(ptr);
+    }
+
+    // hand the calling thread's partial batch to the background thread
+    inline void flush_deferred() {
+        detail::DeferredBatch::getInstance().flush();
+    }
+
+    // flush the calling thread's batch and block until it has been freed
+    inline void wait_deferred() {
+        detail::DeferredBatch::getInstance().flush();
+        detail::Reclaimer::getInstance().wait();
+    }
+
+    // bytes ptr can hold: its size class, or the whole pages of a large object
+    inline size_t malloc_usable_size(void* ptr) {
+        if (ptr == nullptr) {
+            return 0;
+        }
+
+        using namespace detail;
+
+        auto span = PageHeap::getInstance().findSpan(ptr);
+        if (span->size_ > settings.large_threshold) {
+            return span->pageCount_ << PageShift;
+        }
+        return span->size_;
+    }
+
+    struct sized_ptr {
+        void* ptr;
+        size_t size;  // usable bytes, at least the requested ones
+    };
+
+    // malloc that also returns the usable size, so a growing buffer can take
+    // the slack of the size class instead of reallocating early
+    inline sized_ptr malloc_at_least(size_t bytes) {
+        using namespace detail;
+
+        auto res = malloc(bytes);
+        if (res == nullptr) {
+            return {};
+        }
+        if (bytes > settings.large_threshold) {
+            return { res, malloc_usable_size(res) };
+        }
+        return { res, Helper::bytesToSize(bytes) };
+    }
+
+    // stays in place while new_bytes fits and fills more than half of the
+    // memblock, otherwise moves the contents to a new one
+    inline void* realloc(void* ptr, size_t new_bytes) {
+        auto usable = malloc_usable_size(ptr);
+        if (new_bytes != 0 && new_bytes <= usable && new_bytes > usable / 2) {
+#if defined(MTMALLOC_TRACE)
+            detail::traceRecord(trace_op::realloc, ptr, ptr, new_bytes);
+#endif
+            return ptr;
+        }
+
+        void* res;
+        {
+#if defined(MTMALLOC_TRACE)
+            // the seq is taken after the malloc, as for a plain malloc
+            detail::TraceSuspender suspender;
+#endif
+            res = malloc(new_bytes);
+            if (res != nullptr && ptr != nullptr) {
+                memcpy(res, ptr, std::min(usable, new_bytes));
+            }
+            free(ptr);
+        }
+#if defined(MTMALLOC_TRACE)
+        detail::traceRecord(trace_op::realloc, res, ptr, new_bytes);
+#endif
+        return res;
+    }
+
+    /*
+     * Memory Limit API
+     */
+
+    // bytes currently mapped from the OS, including allocator metadata
+    inline size_t mapped_bytes() {
+        return detail::mappedBytes.load(std::memory_order_relaxed);
+    }
+
+    // mapped bytes minus the free pages already released to the OS
+    inline size_t heap_bytes() {
+        return detail::SoftLimit::heapBytes();
+    }
+
+    // when the heap approaches limit bytes, thread caches are flushed and free
+    // page heap spans are released to the OS; if it still grows past the limit,
+    // callback runs on the allocating thread outside of allocator locks.
+    // 0 removes the limit
+    inline void set_soft_limit(size_t bytes, soft_limit_callback callback = nullptr) {
+        detail::SoftLimit::getInstance().set(bytes, callback);
+    }
+
+    inline size_t soft_limit() {
+        return detail::SoftLimit::getInstance().limit();
+    }
+
+    // mapped bytes taken by allocator metadata: spans, page map nodes and
+    // thread caches. Grows with the number of spans and pages, so a larger
+    // MTMALLOC_PAGE_SHIFT shrinks it
+    inline size_t metadata_bytes() {
+        return detail::metadataBytes.load(std::memory_order_relaxed);
+    }
+
+    // flush the calling thread's cache, ask other threads to flush theirs and
+    // release every free page heap span
+    inline void release_free_memory() {
+        using namespace detail;
+
+        if (tc != nullptr) {
+            tc->flush();
+        }
+        flushEpoch.fetch_add(1, std::memory_order_relaxed);
+
+        std::lock_guard<Mutex> pageHeapLock{ PageHeap::getInstance().mtx_ };
+        PageHeap::getInstance().releaseFreeSpans(0);
+    }
+
+    /*
+     * Prewarm API
+     */
+
+    // map at least bytes of page heap memory up front so the first requests
+    // do not pay for SysAlloc; with prefault the pages are faulted in as well
+    // (MAP_POPULATE). Returns the bytes mapped
+    inline size_t reserve(size_t bytes, bool prefault = false) {
+        using namespace detail;
+
+        std::lock_guard<Mutex> pageHeapLock{ PageHeap::getInstance().mtx_ };
+        return PageHeap::getInstance().reserve(bytes, prefault);
+    }
+
+    struct prewarm_entry {
+        size_t bytes;  // any request size of the class
+        size_t count;  // memblocks to keep in the thread cache
+    };
+
+    // create the calling thread's cache and fill it as profile says, so its
+    // first allocations of those classes are free list pops. Sizes above the
+    // thread cache limit are skipped, reserve covers them
+    inline void prewarm_thread(const prewarm_entry* profile, size_t n) {
+        using namespace detail;
+
+        auto cache = threadCache();
+        for (size_t i = 0; i < n; ++i) {
+            if (profile[i].bytes > 0 && profile[i].bytes <= settings.large_threshold) {
+                cache->prewarm(profile[i].bytes, profile[i].count);
+            }
+        }
+    }
+
+    inline void prewarm_thread(std::initializer_list<prewarm_entry> profile) {
+        prewarm_thread(profile.begin(), profile.size());
+    }
+
+    /*
+     * Config API
+     */
+
+    // the configuration in effect, MTMALLOC_CONF included
+    inline config get_config() {
+        return detail::settings;
+    }
+
+    // replace the configuration, return false if it is invalid or the heap
+    // is already in use. Call it before the first allocation of any thread;
+    // compile-time limits (256K size classes, span classes up to 128 pages)
+    // bound large_threshold and span_pages
+    inline bool set_config(const config& conf) {
+        return detail::Config::apply(conf);
+    }
+
+#if defined(MTMALLOC_NUMA)
+
+    /*
+     * NUMA API
+     */
+
+    // the topology read from the kernel, a base for simulated ones
+    inline numa_topology system_numa_topology() {
+        return detail::Numa::systemTopology();
+    }
+
+    // replace the topology, return false if a callback is missing or the
+    // heap is already in use. Call it before the first allocation of any thread
+    inline bool set_numa_topology(const numa_topology& topology) {
+        return detail::Numa::setTopology(topology);
+    }
+
+    // nodes in use, at most numa_max_nodes
+    inline size_t numa_node_count() {
+        return detail::Numa::getInstance().nodeCount();
+    }
+
+    // the node the calling thread's next refill comes from
+    inline size_t numa_current_node() {
+        return detail::Numa::getInstance().currentNode();
+    }
+
+#endif
+
+    /*
+     * Heap Walk API
+     */
+
+    inline constexpr size_t size_class_num = detail::MaxBucketNum;
+
+    // call visit(const span_info&) for every span: free spans and large objects
+    // under the page heap lock, then small spans under their bucket's lock.
+    // visit must not call into mtmalloc
+    template <typename F>
+    inline void walk_spans(F&& visit) {
+        using namespace detail;
+
+        auto info = [](Span* span, int sizeClass) {
+            span_info res{};
+            res.begin = Helper::spanToBeginAddress(span);
+            res.page_count = span->pageCount_;
+            res.size_class = sizeClass;
+            res.in_use = span->isUsing_;
+            res.cold = span->isCold_;
+            res.released = span->isReleased_;
+            res.node = span->node_;
+            if (span->isUsing_) {
+                res.size = span->size_;
+                res.objects = (span->pageCount_ << PageShift) / span->size_;
+                res.use_count = sizeClass < 0 ? 1 : static_cast<size_t>(span->useCount_);
+            }
+            return res;
+        };
+
+        {
+            std::lock_guard<Mutex> pageHeapLock{ PageHeap::getInstance().mtx_ };
+            PageHeap::getInstance().walk([&](Span* span) {
+                visit(static_cast<const span_info&>(info(span, -1)));
+            });
+        }
+        auto visitSmall = [&](Span* span, size_t index) {
+            visit(static_cast<const span_info&>(info(span, static_cast<int>(index))));
+        };
+        CentralCache::getInstance().walk(visitSmall);
+        ColdCentralCache::getInstance().walk(visitSmall);
+    }
+
+    struct fragmentation_report {
+        static constexpr size_t histogram_num = 10;
+
+        struct size_class_stats {
+            size_t size;
+            size_t spans;
+            size_t objects;  // memblocks in those spans
+            size_t in_use;   // memblocks handed out, those in thread caches included
+            size_t utilization[histogram_num];  // spans by used tenths, full in the last
+        };
+
+        size_class_stats classes[size_class_num];
+        size_t large_spans;
+        size_t large_bytes;
+        size_t free_spans;
+        size_t free_pages;
+        size_t released_pages;
+        size_t largest_free_run;  // pages, adjacent free spans counted as one run
+    };
+
+    // low utilization in a class points at partially used spans, many free
+    // pages with a short largest run at page heap splintering. The spans are
+    // not visited at one instant, so under load the numbers are approximate
+    inline fragmentation_report fragmentation() {
+        fragmentation_report res{};
+        std::vector<std::pair<uintptr_t, size_t>> freeRuns;
+
+        walk_spans([&](const span_info& span) {
+            if (!span.in_use) {
+                ++res.free_spans;
+                res.free_pages += span.page_count;
+                res.released_pages += span.released ? span.page_count : 0;
+                freeRuns.emplace_back(reinterpret_cast<uintptr_t>(span.begin), span.page_count);
+            }
+            else if (span.size_class < 0) {
+                ++res.large_spans;
+                res.large_bytes += span.size;
+            }
+            else {
+                auto& stats = res.classes[span.size_class];
+                auto tenth = span.use_count * fragmentation_report::histogram_num / span.objects;
+                stats.size = span.size;
+                ++stats.spans;
+                stats.objects += span.objects;
+                stats.in_use += span.use_count;
+                ++stats.utilization[std::min(tenth, fragmentation_report::histogram_num - 1)];
+            }
+        });
+
+        std::sort(freeRuns.begin(), freeRuns.end());
+        uintptr_t end{};
+        size_t run{};
+        for (const auto& [begin, pages] : freeRuns) {
+            run = begin == end ? run + pages : pages;
+            end = begin + (pages << detail::PageShift);
+            res.largest_free_run = std::max(res.largest_free_run, run);
+        }
+        return res;
+    }
+
+#if defined(MTMALLOC_TRACE)
+
+    /*
+     * Trace API
+     */
+
+    // log every malloc/free/realloc to path until trace_stop,
+    // return false if a trace is already running or path cannot be opened
+    inline bool trace_start(const char* path) {
+        return detail::Tracer::getInstance().start(path);
+    }
+
+    // flush the records of every thread and close the trace file
+    inline void trace_stop() {
+        detail::Tracer::getInstance().stop();
+    }
+
+#endif
+
+#if defined(MTMALLOC_LATENCY_STATS)
+
+    /*
+     * Latency Stats API
+     */
+
+    // snapshot of one slow path's histogram, in TSC ticks
+    inline latency_histogram latency_stats(latency_path path) {
+        assert(path < latency_path::count);
+
+        latency_histogram res{};
+        detail::latencyHistograms[static_cast<size_t>(path)].read(res);
+        return res;
+    }
+
+    inline void reset_latency_stats() {
+        for (auto& histogram : detail::latencyHistograms) {
+            histogram.reset();
+        }
+    }
+
+#endif
+
+#if defined(MTMALLOC_TAGS)
+
+    /*
+     * Tag API
+     */
+
+    // allocations of this thread are attributed to tag until the scope ends;
+    // scopes nest and restore the previous tag
+    class tag_scope {
+    public:
+        explicit tag_scope(tag_t tag) noexcept : prev_{ detail::currentTag } {
+            detail::currentTag = tag;
+        }
+
+        ~tag_scope() { detail::currentTag = prev_; }
+
+        tag_scope(const tag_scope&) = delete;
+        tag_scope& operator=(const tag_scope&) = delete;
+
+    private:
+        tag_t prev_;
+    };
+
+    inline tag_t current_tag() {
+        return detail::currentTag;
+    }
+
+    // counters of all threads are summed at query time
+    inline tag_stats tag_usage(tag_t tag) {
+        return detail::Tagger::getInstance().usage(tag);
+    }
+
+#endif
+
+#if defined(MTMALLOC_CONTENTION_STATS)
+
+    /*
+     * Lock Stats API
+     */
+
+    // bucket is the size-class index, see size_class_index; with MTMALLOC_NUMA
+    // every node has its own buckets, and cold memory has buckets of its own
+    inline lock_stats central_cache_lock_stats(size_t bucket, size_t node = 0,
+        hint h = hint::hot) {
+        lock_stats res{};
+        if (h == hint::hot) {
+            detail::CentralCache::getInstance().bucketMutex(bucket, node).read(res);
+        } else {
+            detail::ColdCentralCache::getInstance().bucketMutex(bucket, node).read(res);
+        }
+        return res;
+    }
+
+    inline lock_stats page_heap_lock_stats() {
+        lock_stats res{};
+        detail::PageHeap::getInstance().mtx_.read(res);
+        return res;
+    }
+
+    inline size_t size_class_index(size_t bytes) {
+        return detail::Helper::bytesToIndex(bytes);
+    }
+
+    inline void reset_lock_stats() {
+        for (size_t node = 0; node < detail::MaxNodeNum; ++node) {
+            for (size_t i = 0; i < detail::MaxBucketNum; ++i) {
+                detail::CentralCache::getInstance().bucketMutex(i, node).reset();
+                detail::ColdCentralCache::getInstance().bucketMutex(i, node).reset();
+            }
+        }
+        detail::PageHeap::getInstance().mtx_.reset();
+    }
+
+#endif
 
 }  // namespace mtmalloc
 
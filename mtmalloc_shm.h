@@ -0,0 +1,790 @@
+//
+//  mtmalloc_shm.h
+//
+//  Copyright (c) 2024 siestaaaaaa. All rights reserved.
+//  MIT License
+//
+
+#ifndef MTMALLOC_SHM_H
+#define MTMALLOC_SHM_H
+
+/*
+ * Headers
+ */
+
+#include "mtmalloc.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <new>
+#include <system_error>
+#include <type_traits>
+
+#if defined(__linux__) || defined(linux)
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+#else
+ // TODO: support other platform
+#endif
+
+// A heap in a named shared memory object that several processes map at
+// once. Everything in the region refers to other parts of it by offset, so
+// each process may map it at a different address; objects are exchanged
+// between processes by offset. There is no thread cache: each size class is
+// guarded by a process-shared mutex, and a process that dies holding one
+// leaves it to be recovered by the next locker.
+//
+// The same heap can be backed by a file instead and mapped at a fixed
+// address. All allocator metadata is in the file, so a restarted process
+// maps it again at that address and finds its objects, pointers included,
+// where it left them; root slots tell it where to start.
+
+#if defined(__linux__) || defined(linux)
+
+namespace mtmalloc {
+
+    namespace shm {
+
+        // offset of a memblock from the start of the region, 0 is null
+        using offset_t = uint64_t;
+
+        namespace detail {
+
+            using mtmalloc::detail::Helper;
+            using mtmalloc::detail::MaxBucketNum;
+            using mtmalloc::detail::MaxPageNum;
+            using mtmalloc::detail::PageShift;
+            using mtmalloc::detail::TCMaxSize;
+
+            inline constexpr char Magic[8]{ 'M', 'T', 'S', 'H', 'E', 'A', 'P', '\0' };
+            inline constexpr uint32_t Version = 3;
+            inline constexpr size_t RootNum = 16;
+            // how long open waits for the creator to size and format the object
+            inline constexpr std::chrono::seconds ReadyTimeout{ 5 };
+
+            // FNV-1a of the class sizes, a heap formatted by a build with
+            // another table, see MTMALLOC_SIZE_CLASSES_HEADER, is refused
+            inline constexpr uint64_t SizeClassHash = [] {
+                uint64_t res = 0xcbf29ce484222325ull;
+                for (auto size = Helper::bytesToSize(1);; size = Helper::bytesToSize(size + 1)) {
+                    res = (res ^ size) * 0x100000001b3ull;
+                    if (size >= TCMaxSize) {
+                        return res;
+                    }
+                }
+            }();
+
+            // spans are named by their first page, NoSpan ends a list
+            inline constexpr uint32_t NoSpan = UINT32_MAX;
+
+            enum class SpanState : uint8_t {
+                free,
+                small,
+                large,
+            };
+
+            // describes the span starting at its page; only the entries of
+            // first pages are meaningful
+            struct Span {
+                uint32_t pageCount;
+                uint32_t size;      // memblock size of a small span
+                uint32_t useCount;
+                uint32_t next;
+                uint32_t prev;
+                SpanState state;
+                offset_t freeList;  // memblocks of a small span
+            };
+
+            struct Header {
+                char magic[8];
+                uint32_t version;
+                std::atomic<uint32_t> ready;  // set once the creator is done
+                uint32_t pageShift;           // of the build that formatted it
+                uint64_t sizeClasses;         // SizeClassHash of that build
+
+                uint64_t bytes;       // size of the region
+                uint64_t address;     // fixed mapping address of a heap file, or 0
+                uint32_t clean;       // a heap file was closed, not abandoned
+                uint64_t dataOffset;  // first page handed out
+                uint32_t pageCount;   // pages after dataOffset
+                uint64_t spanOffset;  // Span[pageCount]
+                uint64_t mapOffset;   // uint32_t[pageCount], page -> first page
+
+                pthread_mutex_t pageHeapMtx;
+                uint32_t freeSpans[MaxPageNum];  // by page count, the last holds the rest
+
+                pthread_mutex_t bucketMtx[MaxBucketNum];
+                uint32_t buckets[MaxBucketNum];  // small spans with free memblocks
+
+                offset_t roots[RootNum];
+            };
+
+            static_assert(std::atomic<uint32_t>::is_always_lock_free);
+
+            // robust lock, state left by a dead owner is taken over as it is
+            class Lock {
+            public:
+                explicit Lock(pthread_mutex_t& mtx) : mtx_{ mtx } {
+                    if (pthread_mutex_lock(&mtx_) == EOWNERDEAD) {
+                        pthread_mutex_consistent(&mtx_);
+                    }
+                }
+
+                ~Lock() { pthread_mutex_unlock(&mtx_); }
+
+                Lock(const Lock&) = delete;
+                Lock& operator=(const Lock&) = delete;
+
+            private:
+                pthread_mutex_t& mtx_;
+            };
+
+            inline void initMutex(pthread_mutex_t& mtx) {
+                pthread_mutexattr_t attr;
+                pthread_mutexattr_init(&attr);
+                pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+                pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+                pthread_mutex_init(&mtx, &attr);
+                pthread_mutexattr_destroy(&attr);
+            }
+
+            inline constexpr size_t align(size_t bytes, size_t alignNum) {
+                return (bytes + alignNum - 1) & ~(alignNum - 1);
+            }
+
+            [[noreturn]] inline void throwErrno(const char* what) {
+                throw std::system_error{ errno, std::generic_category(), what };
+            }
+
+            class FileDescriptor {
+            public:
+                explicit FileDescriptor(int fd) : fd_{ fd } {}
+
+                ~FileDescriptor() {
+                    if (fd_ >= 0) {
+                        close(fd_);
+                    }
+                }
+
+                FileDescriptor(const FileDescriptor&) = delete;
+                FileDescriptor& operator=(const FileDescriptor&) = delete;
+
+                [[nodiscard]] int get() const { return fd_; }
+
+                int release() {
+                    auto fd = fd_;
+                    fd_ = -1;
+                    return fd;
+                }
+
+            private:
+                int fd_;
+            };
+
+        }  // namespace detail
+
+        // a mapped heap region, does not own the mapping; it is one pointer
+        // wide, so it can be kept inside the region when that is always mapped
+        // at the same address
+        class region {
+        public:
+            region() = default;
+
+            explicit region(void* base) noexcept : base_{ static_cast<char*>(base) } {}
+
+            static constexpr size_t root_num = detail::RootNum;
+
+            // roots are kept as offsets, so they survive remapping anywhere
+            void set_root(size_t slot, const void* ptr) {
+                assert(slot < root_num);
+                header()->roots[slot] = to_offset(ptr);
+            }
+
+            [[nodiscard]] void* root(size_t slot) const {
+                assert(slot < root_num);
+                return from_offset(header()->roots[slot]);
+            }
+
+            void* allocate(size_t bytes) {
+                using namespace detail;
+
+                if (bytes == 0) {
+                    return {};
+                }
+
+                if (bytes > TCMaxSize) {
+                    auto pageNum = (bytes + (size_t{ 1 } << PageShift) - 1) >> PageShift;
+                    Lock pageHeapLock{ header()->pageHeapMtx };
+                    return pageToAddress(allocateSpan(pageNum, SpanState::large));
+                }
+
+                auto size = Helper::bytesToSize(bytes);
+                auto index = Helper::bytesToIndex(bytes);
+
+                Lock bucketLock{ header()->bucketMtx[index] };
+                auto id = header()->buckets[index];
+                if (id == NoSpan) {
+                    id = carveSpan(size);
+                    push(header()->buckets[index], id);
+                }
+
+                auto& span = spans()[id];
+                auto res = from_offset(span.freeList);
+                span.freeList = next(res);
+                ++span.useCount;
+                if (span.freeList == 0) {
+                    erase(header()->buckets[index], id);
+                }
+                return res;
+            }
+
+            void deallocate(void* ptr) {
+                using namespace detail;
+
+                if (ptr == nullptr) {
+                    return;
+                }
+
+                auto id = findSpan(ptr);
+                auto& span = spans()[id];
+                if (span.state == SpanState::large) {
+                    Lock pageHeapLock{ header()->pageHeapMtx };
+                    deallocateSpan(id);
+                    return;
+                }
+
+                auto index = Helper::bytesToIndex(span.size);
+                Lock bucketLock{ header()->bucketMtx[index] };
+                auto wasFull = span.freeList == 0;
+                next(ptr) = span.freeList;
+                span.freeList = to_offset(ptr);
+
+                if (--span.useCount == 0) {
+                    if (!wasFull) {
+                        erase(header()->buckets[index], id);
+                    }
+                    Lock pageHeapLock{ header()->pageHeapMtx };
+                    deallocateSpan(id);
+                }
+                else if (wasFull) {
+                    push(header()->buckets[index], id);
+                }
+            }
+
+            [[nodiscard]] offset_t to_offset(const void* ptr) const {
+                if (ptr == nullptr) {
+                    return 0;
+                }
+                assert(contains(ptr));
+                return static_cast<offset_t>(static_cast<const char*>(ptr) - base_);
+            }
+
+            [[nodiscard]] void* from_offset(offset_t offset) const {
+                return offset == 0 ? nullptr : base_ + offset;
+            }
+
+            template <typename T>
+            [[nodiscard]] T* get(offset_t offset) const {
+                return static_cast<T*>(from_offset(offset));
+            }
+
+            [[nodiscard]] bool contains(const void* ptr) const {
+                auto p = static_cast<const char*>(ptr);
+                return p >= base_ && p < base_ + capacity();
+            }
+
+            [[nodiscard]] void* base() const { return base_; }
+
+            [[nodiscard]] size_t capacity() const { return header()->bytes; }
+
+        protected:
+            // lay out the metadata and put every page in one free span
+            void format(size_t bytes) {
+                using namespace detail;
+
+                auto pageSize = size_t{ 1 } << PageShift;
+                auto totalPages = bytes >> PageShift;
+                auto metaBytes = align(
+                    sizeof(Header) + totalPages * (sizeof(Span) + sizeof(uint32_t)), pageSize);
+                if (metaBytes >= bytes) {
+                    throw std::system_error{ EINVAL, std::generic_category(),
+                        "shared heap too small" };
+                }
+
+                auto h = new (base_) Header{};
+                h->bytes = bytes;
+                h->dataOffset = metaBytes;
+                h->pageCount = static_cast<uint32_t>((bytes - metaBytes) >> PageShift);
+                h->spanOffset = align(sizeof(Header), alignof(Span));
+                h->mapOffset = h->spanOffset + totalPages * sizeof(Span);
+
+                initMutex(h->pageHeapMtx);
+                std::fill(std::begin(h->freeSpans), std::end(h->freeSpans), NoSpan);
+                for (auto& mtx : h->bucketMtx) {
+                    initMutex(mtx);
+                }
+                std::fill(std::begin(h->buckets), std::end(h->buckets), NoSpan);
+
+                spans()[0] = Span{ h->pageCount, 0, 0, NoSpan, NoSpan, SpanState::free, 0 };
+                deallocateSpan(0);
+
+                h->version = Version;
+                h->pageShift = PageShift;
+                h->sizeClasses = SizeClassHash;
+                std::memcpy(h->magic, Magic, sizeof(Magic));
+                h->ready.store(1, std::memory_order_release);
+            }
+
+            [[nodiscard]] detail::Header* header() const {
+                return reinterpret_cast<detail::Header*>(base_);
+            }
+
+            [[nodiscard]] detail::Span* spans() const {
+                return reinterpret_cast<detail::Span*>(base_ + header()->spanOffset);
+            }
+
+            [[nodiscard]] uint32_t* pageMap() const {
+                return reinterpret_cast<uint32_t*>(base_ + header()->mapOffset);
+            }
+
+            [[nodiscard]] void* pageToAddress(uint32_t page) const {
+                return base_ + header()->dataOffset + (offset_t{ page } << detail::PageShift);
+            }
+
+            [[nodiscard]] uint32_t findSpan(const void* ptr) const {
+                auto offset = to_offset(ptr) - header()->dataOffset;
+                return pageMap()[offset >> detail::PageShift];
+            }
+
+            // memblocks link each other by offset
+            [[nodiscard]] static offset_t& next(void* memblock) {
+                return *static_cast<offset_t*>(memblock);
+            }
+
+            void push(uint32_t& list, uint32_t id) const {
+                auto& span = spans()[id];
+                span.prev = detail::NoSpan;
+                span.next = list;
+                if (list != detail::NoSpan) {
+                    spans()[list].prev = id;
+                }
+                list = id;
+            }
+
+            void erase(uint32_t& list, uint32_t id) const {
+                auto& span = spans()[id];
+                if (span.prev != detail::NoSpan) {
+                    spans()[span.prev].next = span.next;
+                }
+                else {
+                    list = span.next;
+                }
+                if (span.next != detail::NoSpan) {
+                    spans()[span.next].prev = span.prev;
+                }
+            }
+
+            [[nodiscard]] uint32_t& freeList(uint32_t pageCount) const {
+                return header()->freeSpans[std::min<size_t>(pageCount, detail::MaxPageNum - 1)];
+            }
+
+            // holding the bucket lock, take a span from the page heap and split it
+            // into memblocks of size
+            uint32_t carveSpan(size_t size) {
+                using namespace detail;
+
+                uint32_t id{};
+                {
+                    Lock pageHeapLock{ header()->pageHeapMtx };
+                    id = allocateSpan(Helper::sizeToPageNum(size), SpanState::small);
+                }
+
+                auto& span = spans()[id];
+                span.size = static_cast<uint32_t>(size);
+                span.useCount = 0;
+
+                auto begin = static_cast<char*>(pageToAddress(id));
+                auto count = (size_t{ span.pageCount } << PageShift) / size;
+                for (size_t i = 0; i + 1 < count; ++i) {
+                    next(begin + i * size) = to_offset(begin + (i + 1) * size);
+                }
+                next(begin + (count - 1) * size) = 0;
+                span.freeList = to_offset(begin);
+                return id;
+            }
+
+            // holding the page heap lock; the span is marked in use before the
+            // lock is dropped so it is never coalesced by another process
+            uint32_t allocateSpan(size_t pageNum, detail::SpanState state) {
+                using namespace detail;
+
+                auto id = NoSpan;
+                for (auto i = std::min(pageNum, MaxPageNum - 1); i < MaxPageNum; ++i) {
+                    for (auto cur = header()->freeSpans[i]; cur != NoSpan;
+                        cur = spans()[cur].next) {
+                        if (spans()[cur].pageCount >= pageNum) {
+                            id = cur;
+                            break;
+                        }
+                    }
+                    if (id != NoSpan) {
+                        break;
+                    }
+                }
+                if (id == NoSpan) {
+                    throw std::bad_alloc{};
+                }
+
+                auto& span = spans()[id];
+                erase(freeList(span.pageCount), id);
+                span.state = state;
+                if (span.pageCount > pageNum) {
+                    auto rest = static_cast<uint32_t>(id + pageNum);
+                    spans()[rest] = Span{ static_cast<uint32_t>(span.pageCount - pageNum), 0,
+                        0, NoSpan, NoSpan, SpanState::free, 0 };
+                    span.pageCount = static_cast<uint32_t>(pageNum);
+                    insertFree(rest);
+                }
+
+                for (uint32_t i = 0; i < span.pageCount; ++i) {
+                    pageMap()[id + i] = id;
+                }
+                return id;
+            }
+
+            // holding the page heap lock, coalesce with free neighbours
+            void deallocateSpan(uint32_t id) {
+                using namespace detail;
+
+                auto pageCount = spans()[id].pageCount;
+                if (id > 0) {
+                    auto prev = pageMap()[id - 1];
+                    if (spans()[prev].state == SpanState::free) {
+                        erase(freeList(spans()[prev].pageCount), prev);
+                        pageCount += spans()[prev].pageCount;
+                        id = prev;
+                    }
+                }
+                auto nextId = id + pageCount;
+                if (nextId < header()->pageCount && spans()[nextId].state == SpanState::free) {
+                    erase(freeList(spans()[nextId].pageCount), nextId);
+                    pageCount += spans()[nextId].pageCount;
+                }
+
+                spans()[id] =
+                    Span{ pageCount, 0, 0, NoSpan, NoSpan, SpanState::free, 0 };
+                insertFree(id);
+            }
+
+            void insertFree(uint32_t id) {
+                auto& span = spans()[id];
+                span.state = detail::SpanState::free;
+                pageMap()[id] = id;
+                pageMap()[id + span.pageCount - 1] = id;
+                push(freeList(span.pageCount), id);
+            }
+
+            char* base_{};
+        };
+
+        // owns the mapping of a shared memory object or a heap file
+        class heap : public region {
+        public:
+            // create the shared memory object name of bytes and map it, fails
+            // if it already exists; the name is removed again if it cannot be
+            // formatted
+            static heap create(const char* name, size_t bytes) {
+                using namespace detail;
+
+                FileDescriptor fd{ shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600) };
+                if (fd.get() < 0) {
+                    throwErrno("shm_open");
+                }
+                bytes &= ~((size_t{ 1 } << PageShift) - 1);
+                if (ftruncate(fd.get(), static_cast<off_t>(bytes)) != 0) {
+                    auto err = errno;
+                    shm_unlink(name);
+                    errno = err;
+                    throwErrno("ftruncate");
+                }
+
+                try {
+                    heap res{ fd.get(), bytes, nullptr };
+                    res.format(bytes);
+                    return res;
+                }
+                catch (...) {
+                    shm_unlink(name);
+                    throw;
+                }
+            }
+
+            // map an existing shared memory object created by create(), fails
+            // with ETIMEDOUT if its creator does not finish within ReadyTimeout,
+            // as when it died formatting; such an object has to be unlinked
+            static heap open(const char* name) {
+                using namespace detail;
+
+                FileDescriptor fd{ shm_open(name, O_RDWR, 0) };
+                if (fd.get() < 0) {
+                    throwErrno("shm_open");
+                }
+                auto deadline = std::chrono::steady_clock::now() + ReadyTimeout;
+                struct stat st {};
+                while (true) {
+                    if (fstat(fd.get(), &st) != 0) {
+                        throwErrno("fstat");
+                    }
+                    if (st.st_size != 0) {
+                        break;
+                    }
+                    // the creator has not sized it yet
+                    waitReady(deadline);
+                }
+
+                heap res{ fd.get(), static_cast<size_t>(st.st_size), nullptr };
+                res.validate(deadline);
+                return res;
+            }
+
+            // create a heap file at path of bytes and map it at address, or
+            // where the kernel likes when address is null; open_file maps it
+            // at the same address again
+            static heap create_file(const char* path, size_t bytes, void* address = nullptr) {
+                using namespace detail;
+
+                FileDescriptor fd{ ::open(path, O_CREAT | O_EXCL | O_RDWR, 0600) };
+                if (fd.get() < 0) {
+                    throwErrno("open");
+                }
+                lockFile(fd.get());
+                bytes &= ~((size_t{ 1 } << PageShift) - 1);
+                if (ftruncate(fd.get(), static_cast<off_t>(bytes)) != 0) {
+                    auto err = errno;
+                    unlink(path);
+                    errno = err;
+                    throwErrno("ftruncate");
+                }
+
+                try {
+                    heap res{ fd.get(), bytes, address };
+                    res.file_ = true;
+                    res.lockFd_ = fd.release();
+                    res.format(bytes);
+                    res.header()->address = reinterpret_cast<uintptr_t>(res.base_);
+                    return res;
+                }
+                catch (...) {
+                    unlink(path);
+                    throw;
+                }
+            }
+
+            // map a heap file at the address it was created at, fails with
+            // EEXIST if something else is mapped there, and with EBUSY if
+            // another heap has the file open
+            static heap open_file(const char* path) {
+                using namespace detail;
+
+                FileDescriptor fd{ ::open(path, O_RDWR) };
+                if (fd.get() < 0) {
+                    throwErrno("open");
+                }
+                lockFile(fd.get());
+                struct stat st {};
+                if (fstat(fd.get(), &st) != 0) {
+                    throwErrno("fstat");
+                }
+                uint64_t address{};
+                if (pread(fd.get(), &address, sizeof(address), offsetof(Header, address)) !=
+                    static_cast<ssize_t>(sizeof(address))) {
+                    throw std::system_error{ EINVAL, std::generic_category(),
+                        "not an mtmalloc heap file" };
+                }
+
+                heap res{ fd.get(), static_cast<size_t>(st.st_size),
+                    reinterpret_cast<void*>(address) };
+                res.file_ = true;
+                res.lockFd_ = fd.release();
+                res.validate();
+
+                // the file lock shows no process has the heap mapped, locks left
+                // by the previous owner, even from before a reboot, are released
+                auto header = res.header();
+                initMutex(header->pageHeapMtx);
+                for (auto& mtx : header->bucketMtx) {
+                    initMutex(mtx);
+                }
+                res.recovered_ = header->clean == 0;
+                header->clean = 0;
+                return res;
+            }
+
+            // the name goes away, mappings stay valid until they are closed
+            static void remove(const char* name) { shm_unlink(name); }
+
+            heap(heap&& other) noexcept
+                : region{ other.base_ }, bytes_{ other.bytes_ }, file_{ other.file_ },
+                recovered_{ other.recovered_ }, lockFd_{ other.lockFd_ } {
+                other.base_ = nullptr;
+                other.lockFd_ = -1;
+            }
+
+            heap& operator=(heap&& other) noexcept {
+                if (this != &other) {
+                    unmap();
+                    base_ = other.base_;
+                    bytes_ = other.bytes_;
+                    file_ = other.file_;
+                    recovered_ = other.recovered_;
+                    lockFd_ = other.lockFd_;
+                    other.base_ = nullptr;
+                    other.lockFd_ = -1;
+                }
+                return *this;
+            }
+
+            ~heap() { unmap(); }
+
+            // flush objects and allocator metadata of a heap file to disk
+            void checkpoint() const {
+                if (file_ && msync(base_, bytes_, MS_SYNC) != 0) {
+                    detail::throwErrno("msync");
+                }
+            }
+
+            // whether a heap file was last left without being closed; its
+            // objects are all there, but one an allocator call was working on
+            // when the owner died may be half updated
+            [[nodiscard]] bool recovered() const { return recovered_; }
+
+        private:
+            heap(int fd, size_t bytes, void* address) : bytes_{ bytes } {
+                auto flags = MAP_SHARED;
+                if (address != nullptr) {
+                    flags |= MAP_FIXED_NOREPLACE;
+                }
+                auto ptr = mmap(address, bytes, PROT_READ | PROT_WRITE, flags, fd, 0);
+                if (ptr == MAP_FAILED) {
+                    detail::throwErrno("mmap");
+                }
+                if (address != nullptr && ptr != address) {
+                    // kernels before 4.17 take the flag as a hint
+                    munmap(ptr, bytes);
+                    errno = EEXIST;
+                    detail::throwErrno("mmap");
+                }
+                base_ = static_cast<char*>(ptr);
+            }
+
+            // a heap file is locked for as long as it is mapped, so only one
+            // process uses it at a time
+            static void lockFile(int fd) {
+                if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+                    if (errno == EWOULDBLOCK) {
+                        errno = EBUSY;
+                    }
+                    detail::throwErrno("flock");
+                }
+            }
+
+            void unmap() {
+                if (base_ != nullptr) {
+                    if (file_) {
+                        header()->clean = 1;
+                        msync(base_, bytes_, MS_SYNC);
+                    }
+                    munmap(base_, bytes_);
+                    base_ = nullptr;
+                }
+                if (lockFd_ >= 0) {
+                    close(lockFd_);
+                    lockFd_ = -1;
+                }
+            }
+
+            static void waitReady(std::chrono::steady_clock::time_point deadline) {
+                if (std::chrono::steady_clock::now() >= deadline) {
+                    throw std::system_error{ ETIMEDOUT, std::generic_category(),
+                        "shared heap not ready" };
+                }
+                std::this_thread::yield();
+            }
+
+            void validate(std::chrono::steady_clock::time_point deadline = {}) const {
+                using namespace detail;
+
+                auto h = header();
+                while (!file_ && h->ready.load(std::memory_order_acquire) == 0) {
+                    // the creator is still formatting it
+                    waitReady(deadline);
+                }
+                if (h->ready.load(std::memory_order_acquire) == 0 ||
+                    std::memcmp(h->magic, Magic, sizeof(Magic)) != 0 ||
+                    h->version != Version || h->pageShift != PageShift ||
+                    h->sizeClasses != SizeClassHash || h->bytes != bytes_) {
+                    throw std::system_error{ EINVAL, std::generic_category(),
+                        "not an mtmalloc shared heap" };
+                }
+            }
+            size_t bytes_{};
+            bool file_{};
+            bool recovered_{};
+            int lockFd_{ -1 };  // heap files only
+        };
+
+        // lets std containers live in a heap region; their internal pointers are
+        // addresses, so they are only usable where the region is mapped at the
+        // address they were built at, like a heap file reopened by open_file
+        template <class T>
+        struct allocator {
+            using value_type = T;
+            using size_type = std::size_t;
+            using difference_type = std::ptrdiff_t;
+            using propagate_on_container_copy_assignment = std::true_type;
+            using propagate_on_container_move_assignment = std::true_type;
+            using propagate_on_container_swap = std::true_type;
+
+            template <class U>
+            struct rebind {
+                typedef allocator<U> other;
+            };
+
+            explicit allocator(const region& r) noexcept : region_{ r } {}
+
+            template <class U>
+            allocator(const allocator<U>& other) noexcept : region_{ other.region_ } {}
+
+            T* allocate(std::size_t n) { return static_cast<T*>(region_.allocate(n * sizeof(T))); }
+
+            void deallocate(T* p, std::size_t n) { region_.deallocate(p); }
+
+            region region_;
+        };
+
+        template <class T1, class T2>
+        bool operator==(const allocator<T1>& x, const allocator<T2>& y) noexcept {
+            return x.region_.base() == y.region_.base();
+        }
+
+        template <class T1, class T2>
+        bool operator!=(const allocator<T1>& x, const allocator<T2>& y) noexcept {
+            return !(x == y);
+        }
+
+    }  // namespace shm
+
+}  // namespace mtmalloc
+
+#endif
+
+#endif
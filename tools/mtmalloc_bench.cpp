@@ -0,0 +1,694 @@
+//
+//  mtmalloc_bench.cpp
+//
+//  Allocator benchmarks, one JSON object per line on stdout.
+//
+//  build: g++ -std=c++17 -O2 -pthread mtmalloc_bench.cpp -o mtmalloc_bench
+//  usage: mtmalloc_bench [--threads=N] [--allocator=mtmalloc|system]
+//                        [--timeout=S] [workload...]
+//
+//  The classic workloads run against mtmalloc and the system allocator at
+//  1, 2, 4, ... up to N threads (default: the hardware threads), each run in
+//  a process of its own on Linux so peak RSS is its own. They report ops/sec,
+//  peak RSS and latency percentiles of every 16th malloc or free.
+//
+//  A run that crashes, exits with an error or outlives --timeout seconds
+//  (default 600, 0 for none) prints a line with an "error" field instead,
+//  and the tool exits with 1 after the remaining runs.
+//
+//  classic workloads:
+//    fixed          each thread allocates 100 64-byte blocks and frees them
+//    random         each thread replaces random slots of 1000 with 16B-4KB blocks
+//    threadtest     each thread allocates 10000 8-byte blocks and frees them
+//                   (Berger et al., Hoard)
+//    larson         server churn: threads replace random slots of 1000
+//                   16B-1KB blocks and hand their slots to the threads of
+//                   the next round (Larson and Krishnan)
+//    xmalloc        every thread frees what the previous one allocated
+//                   (Lever and Boreham)
+//    cache-scratch  each thread frees a block the main thread allocated, then
+//                   allocates 8 bytes and writes to them; an allocator that
+//                   hands neighbouring bytes to other threads pays for false
+//                   sharing (Berger et al., Hoard)
+//    mstress        threads swap blocks of mixed sizes, up to 1MB, in and out
+//                   of slots shared by all, so most frees are remote
+//                   (mimalloc-bench)
+//
+//  mtmalloc workloads:
+//    teardown  request thread tears down a large tree with free or with
+//              free_deferred, reports per-request teardown latency
+//    pages     random-size churn over a large live set, reports throughput,
+//              metadata bytes and span count for the logical page size the
+//              tool was built with; compare page sizes with
+//                g++ ... -DMTMALLOC_PAGE_SHIFT=13 mtmalloc_bench.cpp
+//              for 8KB, 15 for 32KB and 16 for 64KB pages
+//
+
+#include "../mtmalloc.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__) || defined(linux)
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+    using Clock = std::chrono::steady_clock;
+
+    uint64_t nanosSince(Clock::time_point begin) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - begin)
+            .count();
+    }
+
+    // samples must be sorted
+    uint64_t percentile(const std::vector<uint64_t>& samples, double p) {
+        if (samples.empty()) {
+            return 0;
+        }
+        auto rank = static_cast<size_t>(p / 100.0 * static_cast<double>(samples.size() - 1));
+        return samples[rank];
+    }
+
+    void printLatency(const char* workload, const char* mode,
+        std::vector<uint64_t>& samples) {
+        std::sort(samples.begin(), samples.end());
+        std::printf("{\"workload\": \"%s\", \"mode\": \"%s\", \"samples\": %zu, "
+            "\"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu}\n",
+            workload, mode, samples.size(),
+            static_cast<unsigned long long>(percentile(samples, 50)),
+            static_cast<unsigned long long>(percentile(samples, 90)),
+            static_cast<unsigned long long>(percentile(samples, 99)),
+            static_cast<unsigned long long>(samples.empty() ? 0 : samples.back()));
+        std::fflush(stdout);
+    }
+
+    void resetPeakRss() {
+#if defined(__linux__) || defined(linux)
+        if (auto file = std::fopen("/proc/self/clear_refs", "w")) {
+            std::fputs("5", file);
+            std::fclose(file);
+        }
+#endif
+    }
+
+    size_t peakRssKb() {
+#if defined(__linux__) || defined(linux)
+        if (auto file = std::fopen("/proc/self/status", "r")) {
+            char line[256];
+            size_t res{};
+            while (std::fgets(line, sizeof(line), file)) {
+                if (std::sscanf(line, "VmHWM: %zu kB", &res) == 1) {
+                    break;
+                }
+            }
+            std::fclose(file);
+            if (res != 0) {
+                return res;
+            }
+        }
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+        return static_cast<size_t>(usage.ru_maxrss);
+#else
+        return 0;
+#endif
+    }
+
+    struct Allocator {
+        const char* name;
+        void* (*malloc)(size_t);
+        void (*free)(void*);
+    };
+
+    const Allocator allocators[]{
+        { "mtmalloc", mtmalloc::malloc, mtmalloc::free },
+        { "system", std::malloc, std::free },
+    };
+
+    struct Random {
+        uint64_t state;
+
+        uint64_t operator()() {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            return state;
+        }
+
+        size_t between(size_t lo, size_t hi) {
+            return lo + static_cast<size_t>((*this)() % (hi - lo + 1));
+        }
+    };
+
+    // counts a thread's operations and times every SampleEvery-th one
+    class Recorder {
+    public:
+        static constexpr uint64_t SampleEvery = 16;
+
+        explicit Recorder(const Allocator& alloc) : alloc_(&alloc) {
+            samples_.reserve(size_t{ 1 } << 18);
+        }
+
+        void* malloc(size_t bytes) {
+            if (++ops_ % SampleEvery != 0) {
+                return alloc_->malloc(bytes);
+            }
+            auto begin = Clock::now();
+            auto res = alloc_->malloc(bytes);
+            samples_.push_back(nanosSince(begin));
+            return res;
+        }
+
+        void free(void* ptr) {
+            if (++ops_ % SampleEvery != 0) {
+                alloc_->free(ptr);
+                return;
+            }
+            auto begin = Clock::now();
+            alloc_->free(ptr);
+            samples_.push_back(nanosSince(begin));
+        }
+
+        [[nodiscard]] uint64_t ops() const { return ops_; }
+
+        [[nodiscard]] const std::vector<uint64_t>& samples() const { return samples_; }
+
+    private:
+        const Allocator* alloc_;
+        uint64_t ops_{};
+        std::vector<uint64_t> samples_;
+    };
+
+    struct Result {
+        uint64_t ops{};
+        double seconds{};
+        std::vector<uint64_t> samples;
+    };
+
+    // run body(recorder, thread) on threads threads released together, the
+    // time from release to the last join is added to res
+    template <typename Body>
+    void runThreads(const Allocator& alloc, size_t threads, Result& res, Body body) {
+        std::vector<Recorder> recorders(threads, Recorder{ alloc });
+        std::atomic<size_t> ready{};
+        std::atomic<bool> go{};
+
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < threads; ++i) {
+            workers.emplace_back([&, i] {
+                ready.fetch_add(1);
+                while (!go.load(std::memory_order_acquire)) {
+                    std::this_thread::yield();
+                }
+                body(recorders[i], i);
+            });
+        }
+        while (ready.load() != threads) {
+            std::this_thread::yield();
+        }
+        auto begin = Clock::now();
+        go.store(true, std::memory_order_release);
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        res.seconds += static_cast<double>(nanosSince(begin)) / 1e9;
+
+        for (const auto& recorder : recorders) {
+            res.ops += recorder.ops();
+            res.samples.insert(res.samples.end(), recorder.samples().begin(),
+                recorder.samples().end());
+        }
+    }
+
+    /*
+     * classic workloads
+     */
+
+    void fixed(const Allocator& alloc, size_t threads, Result& res) {
+        constexpr size_t blocks = 100;
+        constexpr size_t rounds = 10000;
+
+        runThreads(alloc, threads, res, [](Recorder& rec, size_t) {
+            void* ptrs[blocks];
+            for (size_t r = 0; r < rounds; ++r) {
+                for (auto& ptr : ptrs) {
+                    ptr = rec.malloc(64);
+                }
+                for (auto ptr : ptrs) {
+                    rec.free(ptr);
+                }
+            }
+        });
+    }
+
+    void randomSlots(const Allocator& alloc, size_t threads, Result& res) {
+        constexpr size_t slots = 1000;
+        constexpr size_t rounds = 1000000;
+
+        runThreads(alloc, threads, res, [](Recorder& rec, size_t thread) {
+            Random rnd{ 0x9E3779B97F4A7C15ull * (thread + 1) };
+            std::vector<void*> ptrs(slots);
+            for (auto& ptr : ptrs) {
+                ptr = rec.malloc(rnd.between(16, 4096));
+            }
+            for (size_t r = 0; r < rounds; ++r) {
+                auto& ptr = ptrs[rnd() % slots];
+                rec.free(ptr);
+                ptr = rec.malloc(rnd.between(16, 4096));
+            }
+            for (auto ptr : ptrs) {
+                rec.free(ptr);
+            }
+        });
+    }
+
+    void threadtest(const Allocator& alloc, size_t threads, Result& res) {
+        constexpr size_t objects = 10000;
+        constexpr size_t rounds = 100;
+
+        runThreads(alloc, threads, res, [](Recorder& rec, size_t) {
+            std::vector<void*> ptrs(objects);
+            for (size_t r = 0; r < rounds; ++r) {
+                for (auto& ptr : ptrs) {
+                    ptr = rec.malloc(8);
+                }
+                for (auto ptr : ptrs) {
+                    rec.free(ptr);
+                }
+            }
+        });
+    }
+
+    void larson(const Allocator& alloc, size_t threads, Result& res) {
+        constexpr size_t slots = 1000;
+        constexpr size_t rounds = 8;
+        constexpr size_t churn = 100000;  // per thread and round
+
+        // the first slots are filled by the main thread, untimed
+        std::vector<std::vector<void*>> sets(threads, std::vector<void*>(slots));
+        Random fill{ 42 };
+        for (auto& set : sets) {
+            for (auto& ptr : set) {
+                ptr = alloc.malloc(fill.between(16, 1024));
+            }
+        }
+
+        for (size_t round = 0; round < rounds; ++round) {
+            runThreads(alloc, threads, res, [&](Recorder& rec, size_t thread) {
+                Random rnd{ 0x9E3779B97F4A7C15ull * (round * threads + thread + 1) };
+                // the slots of another thread of the previous round
+                auto& set = sets[(thread + round) % threads];
+                for (size_t i = 0; i < churn; ++i) {
+                    auto& ptr = set[rnd() % slots];
+                    rec.free(ptr);
+                    ptr = rec.malloc(rnd.between(16, 1024));
+                }
+            });
+        }
+
+        for (auto& set : sets) {
+            for (auto ptr : set) {
+                alloc.free(ptr);
+            }
+        }
+    }
+
+    // single producer, single consumer
+    struct Ring {
+        static constexpr size_t Capacity = 1024;
+
+        alignas(64) std::atomic<size_t> head{};  // next to pop
+        alignas(64) std::atomic<size_t> tail{};  // next to push
+        void* slots[Capacity]{};
+
+        bool full() const {
+            return tail.load(std::memory_order_relaxed) -
+                head.load(std::memory_order_acquire) == Capacity;
+        }
+
+        void push(void* ptr) {
+            auto t = tail.load(std::memory_order_relaxed);
+            slots[t % Capacity] = ptr;
+            tail.store(t + 1, std::memory_order_release);
+        }
+
+        void* pop() {
+            auto h = head.load(std::memory_order_relaxed);
+            if (h == tail.load(std::memory_order_acquire)) {
+                return nullptr;
+            }
+            auto res = slots[h % Capacity];
+            head.store(h + 1, std::memory_order_release);
+            return res;
+        }
+    };
+
+    void xmalloc(const Allocator& alloc, size_t threads, Result& res) {
+        constexpr size_t blocks = 1000000;  // per thread
+
+        // thread i frees what thread i - 1 allocated, a single thread its own
+        std::vector<Ring> rings(threads);
+        runThreads(alloc, threads, res, [&](Recorder& rec, size_t thread) {
+            Random rnd{ 0x9E3779B97F4A7C15ull * (thread + 1) };
+            auto& out = rings[(thread + 1) % threads];
+            auto& in = rings[thread];
+            size_t produced = 0;
+            size_t consumed = 0;
+            while (produced < blocks || consumed < blocks) {
+                auto progress = produced + consumed;
+                for (size_t i = 0; i < 64 && produced < blocks && !out.full(); ++i) {
+                    out.push(rec.malloc(rnd.between(8, 512)));
+                    ++produced;
+                }
+                while (auto ptr = in.pop()) {
+                    rec.free(ptr);
+                    ++consumed;
+                }
+                if (produced + consumed == progress) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    void cacheScratch(const Allocator& alloc, size_t threads, Result& res) {
+        constexpr size_t rounds = 100000;
+        constexpr size_t writes = 100;
+
+        // neighbours, as a simple allocator hands them out
+        std::vector<void*> seeds(threads);
+        for (auto& seed : seeds) {
+            seed = alloc.malloc(8);
+        }
+
+        runThreads(alloc, threads, res, [&](Recorder& rec, size_t thread) {
+            rec.free(seeds[thread]);
+            for (size_t r = 0; r < rounds; ++r) {
+                auto ptr = static_cast<volatile char*>(rec.malloc(8));
+                for (size_t w = 0; w < writes; ++w) {
+                    ptr[w % 8] = static_cast<char>(ptr[w % 8] + 1);
+                }
+                rec.free(const_cast<char*>(ptr));
+            }
+        });
+    }
+
+    void mstress(const Allocator& alloc, size_t threads, Result& res) {
+        constexpr size_t slotsPerThread = 2000;
+        constexpr size_t rounds = 500000;  // per thread
+
+        std::vector<std::atomic<void*>> slots(slotsPerThread * threads);
+        runThreads(alloc, threads, res, [&](Recorder& rec, size_t thread) {
+            Random rnd{ 0x9E3779B97F4A7C15ull * (thread + 1) };
+            for (size_t r = 0; r < rounds; ++r) {
+                auto dice = rnd() % 1000;
+                auto bytes = dice < 900 ? rnd.between(8, 256)
+                    : dice < 990 ? rnd.between(257, 8 * 1024)
+                    : dice < 999 ? rnd.between(8 * 1024 + 1, 256 * 1024)
+                    : rnd.between(256 * 1024 + 1, 1024 * 1024);
+                auto ptr = static_cast<char*>(rec.malloc(bytes));
+                ptr[0] = ptr[bytes - 1] = 1;
+
+                auto old = slots[rnd() % slots.size()].exchange(ptr, std::memory_order_acq_rel);
+                if (old != nullptr) {
+                    rec.free(old);
+                }
+            }
+        });
+
+        for (auto& slot : slots) {
+            alloc.free(slot.load());
+        }
+    }
+
+    void report(const char* workload, const Allocator& alloc, size_t threads, Result& res) {
+        std::sort(res.samples.begin(), res.samples.end());
+        std::printf("{\"workload\": \"%s\", \"allocator\": \"%s\", \"threads\": %zu, "
+            "\"ops\": %llu, \"seconds\": %.6f, \"ops_per_sec\": %.0f, \"peak_rss_kb\": %zu, "
+            "\"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, "
+            "\"max_ns\": %llu}\n",
+            workload, alloc.name, threads, static_cast<unsigned long long>(res.ops),
+            res.seconds, res.seconds > 0 ? static_cast<double>(res.ops) / res.seconds : 0.0,
+            peakRssKb(),
+            static_cast<unsigned long long>(percentile(res.samples, 50)),
+            static_cast<unsigned long long>(percentile(res.samples, 90)),
+            static_cast<unsigned long long>(percentile(res.samples, 99)),
+            static_cast<unsigned long long>(percentile(res.samples, 99.9)),
+            static_cast<unsigned long long>(res.samples.empty() ? 0 : res.samples.back()));
+        std::fflush(stdout);
+    }
+
+    using Body = void (*)(const Allocator&, size_t, Result&);
+
+    // false if the run did not complete
+    bool runIsolated(const char* workload, Body body, const Allocator& alloc, size_t threads,
+        unsigned timeout) {
+        auto run = [&] {
+            resetPeakRss();
+            Result res;
+            body(alloc, threads, res);
+            report(workload, alloc, threads, res);
+        };
+#if defined(__linux__) || defined(linux)
+        auto pid = fork();
+        if (pid == 0) {
+            // a livelocked run is killed by SIGALRM
+            alarm(timeout);
+            run();
+            std::_Exit(0);
+        }
+        if (pid > 0) {
+            int status{};
+            pid_t waited{};
+            do {
+                waited = waitpid(pid, &status, 0);
+            } while (waited < 0 && errno == EINTR);
+            if (waited == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+                return true;
+            }
+            char error[64];
+            if (waited != pid) {
+                std::snprintf(error, sizeof(error), "waitpid failed: %s", std::strerror(errno));
+            }
+            else if (WIFSIGNALED(status)) {
+                std::snprintf(error, sizeof(error), "killed by signal %d (%s)", WTERMSIG(status),
+                    WTERMSIG(status) == SIGALRM ? "timeout" : strsignal(WTERMSIG(status)));
+            }
+            else {
+                std::snprintf(error, sizeof(error), "exited with status %d",
+                    WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+            }
+            std::printf("{\"workload\": \"%s\", \"allocator\": \"%s\", \"threads\": %zu, "
+                "\"error\": \"%s\"}\n", workload, alloc.name, threads, error);
+            std::fflush(stdout);
+            std::fprintf(stderr, "%s with %s at %zu threads: %s\n", workload, alloc.name,
+                threads, error);
+            return false;
+        }
+#endif
+        run();
+        return true;
+    }
+
+    /*
+     * teardown
+     */
+
+    struct Node {
+        Node* left;
+        Node* right;
+        uint64_t payload[4];
+    };
+
+    Node* build(size_t n) {
+        // complete binary tree in breadth-first order
+        std::vector<Node*> nodes(n);
+        for (auto& node : nodes) {
+            node = static_cast<Node*>(mtmalloc::malloc(sizeof(Node)));
+            std::memset(node, 0, sizeof(Node));
+        }
+        for (size_t i = 0; i < n; ++i) {
+            if (2 * i + 1 < n) {
+                nodes[i]->left = nodes[2 * i + 1];
+            }
+            if (2 * i + 2 < n) {
+                nodes[i]->right = nodes[2 * i + 2];
+            }
+        }
+        return n > 0 ? nodes[0] : nullptr;
+    }
+
+    template <typename Free>
+    void destroy(Node* root, Free free) {
+        std::vector<Node*> stack{ root };
+        while (!stack.empty()) {
+            auto node = stack.back();
+            stack.pop_back();
+            if (node == nullptr) {
+                continue;
+            }
+            stack.push_back(node->left);
+            stack.push_back(node->right);
+            free(node);
+        }
+    }
+
+    void teardown() {
+        constexpr size_t nodes = 1000000;
+        constexpr size_t requests = 20;
+
+        std::vector<uint64_t> direct;
+        std::vector<uint64_t> deferred;
+        for (size_t i = 0; i < requests; ++i) {
+            auto root = build(nodes);
+            auto begin = Clock::now();
+            destroy(root, [](Node* node) { mtmalloc::free(node); });
+            direct.push_back(nanosSince(begin));
+
+            root = build(nodes);
+            begin = Clock::now();
+            destroy(root, [](Node* node) { mtmalloc::free_deferred(node); });
+            mtmalloc::flush_deferred();
+            deferred.push_back(nanosSince(begin));
+
+            // let the reclaimer finish outside of the measured request
+            mtmalloc::wait_deferred();
+        }
+        printLatency("teardown", "free", direct);
+        printLatency("teardown", "free_deferred", deferred);
+    }
+
+    /*
+     * pages
+     */
+
+    void pages() {
+        constexpr size_t live = 200000;
+        constexpr size_t ops = 4000000;
+
+        // sizes spread evenly over the orders of magnitude from 16B to 64KB
+        uint64_t rng = 88172645463325252ull;
+        auto next = [&rng] {
+            rng ^= rng << 13;
+            rng ^= rng >> 7;
+            rng ^= rng << 17;
+            return rng;
+        };
+        auto randomSize = [&next] {
+            auto shift = 4 + next() % 12;
+            return (size_t{ 1 } << shift) + next() % (size_t{ 1 } << shift);
+        };
+
+        std::vector<void*> slots(live);
+        for (auto& slot : slots) {
+            slot = mtmalloc::malloc(randomSize());
+        }
+        auto begin = Clock::now();
+        for (size_t i = 0; i < ops; ++i) {
+            auto& slot = slots[next() % live];
+            mtmalloc::free(slot);
+            slot = mtmalloc::malloc(randomSize());
+        }
+        auto seconds = static_cast<double>(nanosSince(begin)) / 1e9;
+
+        size_t spans = 0;
+        mtmalloc::walk_spans([&spans](const mtmalloc::span_info&) { ++spans; });
+        std::printf("{\"workload\": \"pages\", \"page_size\": %zu, \"ops_per_sec\": %.0f, "
+            "\"metadata_bytes\": %zu, \"spans\": %zu, \"mapped_bytes\": %zu}\n",
+            size_t{ 1 } << mtmalloc::detail::PageShift, static_cast<double>(ops) / seconds,
+            mtmalloc::metadata_bytes(), spans, mtmalloc::mapped_bytes());
+        std::fflush(stdout);
+
+        for (auto slot : slots) {
+            mtmalloc::free(slot);
+        }
+    }
+
+    struct Workload {
+        const char* name;
+        Body body;     // compared across allocators and thread counts
+        void (*run)(); // mtmalloc only
+    };
+
+    // classic workloads first, forked before mtmalloc holds any memory here
+    const Workload workloads[]{
+        { "fixed", fixed, nullptr },
+        { "random", randomSlots, nullptr },
+        { "threadtest", threadtest, nullptr },
+        { "larson", larson, nullptr },
+        { "xmalloc", xmalloc, nullptr },
+        { "cache-scratch", cacheScratch, nullptr },
+        { "mstress", mstress, nullptr },
+        { "teardown", nullptr, teardown },
+        { "pages", nullptr, pages },
+    };
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    size_t maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    const Allocator* only{};
+    unsigned timeout = 600;
+    std::vector<const char*> selected;
+
+    for (int i = 1; i < argc; ++i) {
+        if (std::strncmp(argv[i], "--threads=", 10) == 0) {
+            maxThreads = std::max(std::strtoull(argv[i] + 10, nullptr, 10), 1ull);
+        }
+        else if (std::strncmp(argv[i], "--timeout=", 10) == 0) {
+            timeout = static_cast<unsigned>(std::strtoul(argv[i] + 10, nullptr, 10));
+        }
+        else if (std::strncmp(argv[i], "--allocator=", 12) == 0) {
+            for (const auto& alloc : allocators) {
+                if (std::strcmp(argv[i] + 12, alloc.name) == 0) {
+                    only = &alloc;
+                }
+            }
+            if (only == nullptr) {
+                std::fprintf(stderr, "unknown allocator %s\n", argv[i] + 12);
+                return 2;
+            }
+        }
+        else {
+            selected.push_back(argv[i]);
+        }
+    }
+
+    auto failed = false;
+    for (const auto& workload : workloads) {
+        auto chosen = selected.empty() || std::any_of(selected.begin(), selected.end(),
+            [&](const char* name) { return std::strcmp(name, workload.name) == 0; });
+        if (!chosen) {
+            continue;
+        }
+        if (workload.run != nullptr) {
+            workload.run();
+            continue;
+        }
+        for (const auto& alloc : allocators) {
+            if (only != nullptr && only != &alloc) {
+                continue;
+            }
+            for (size_t threads = 1; threads <= maxThreads;
+                threads = threads < maxThreads ? std::min(threads * 2, maxThreads)
+                                               : threads + 1) {
+                if (!runIsolated(workload.name, workload.body, alloc, threads, timeout)) {
+                    failed = true;
+                }
+            }
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,373 @@
+//
+//  mtmalloc_replay.cpp
+//
+//  Replay a trace recorded with MTMALLOC_TRACE against mtmalloc or the
+//  system allocator, keeping the recorded thread interleaving.
+//
+//  build: g++ -std=c++17 -O2 -pthread mtmalloc_replay.cpp -o mtmalloc_replay
+//  usage: mtmalloc_replay <trace> [--allocator=mtmalloc|system] [--order=strict|deps]
+//
+//  --order=strict  every operation waits for its turn in the recorded global
+//                  order, so the interleaving is exactly the recorded one
+//  --order=deps    threads run freely, an operation only waits for the
+//                  allocation it frees or reallocates
+//
+
+#include "../mtmalloc.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__linux__) || defined(linux)
+#include <sys/resource.h>
+#endif
+
+namespace {
+
+    struct Allocator {
+        const char* name;
+        void* (*malloc)(size_t);
+        void (*free)(void*);
+        void* (*realloc)(void*, size_t);
+    };
+
+    const Allocator mtmallocAllocator{ "mtmalloc", mtmalloc::malloc, mtmalloc::free,
+        mtmalloc::realloc };
+    const Allocator systemAllocator{ "system", std::malloc, std::free, std::realloc };
+
+    constexpr uint32_t NoSlot = UINT32_MAX;
+
+    // a trace record with its pointer ids resolved to dense slots
+    struct Op {
+        mtmalloc::trace_op op;
+        uint32_t slot;     // malloc/realloc result, or freed allocation
+        uint32_t oldSlot;  // realloc only
+        uint64_t size;
+    };
+
+    struct Trace {
+        std::vector<Op> ops;                        // in global order
+        std::vector<std::vector<uint32_t>> threads; // op indexes per thread
+        uint32_t slotCount{};
+        uint64_t anomalies{};  // frees of unknown pointers, reused live pointers
+        uint64_t duration{};
+    };
+
+    bool load(const char* path, Trace& trace) {
+        auto file = std::fopen(path, "rb");
+        if (file == nullptr) {
+            std::fprintf(stderr, "cannot open %s\n", path);
+            return false;
+        }
+
+        mtmalloc::trace_header header{};
+        if (std::fread(&header, sizeof(header), 1, file) != 1 ||
+            std::memcmp(header.magic, mtmalloc::trace_magic, sizeof(header.magic)) != 0 ||
+            header.version != mtmalloc::trace_version ||
+            header.record_size != sizeof(mtmalloc::trace_record)) {
+            std::fprintf(stderr, "%s is not an mtmalloc trace\n", path);
+            std::fclose(file);
+            return false;
+        }
+
+        std::vector<mtmalloc::trace_record> records;
+        mtmalloc::trace_record record{};
+        while (std::fread(&record, sizeof(record), 1, file) == 1) {
+            records.push_back(record);
+        }
+        std::fclose(file);
+
+        std::sort(records.begin(), records.end(),
+            [](const auto& a, const auto& b) { return a.seq < b.seq; });
+        if (!records.empty()) {
+            trace.duration = records.back().timestamp - records.front().timestamp;
+        }
+
+        std::unordered_map<uint32_t, uint32_t> threadIndex;
+        std::unordered_map<uint64_t, uint32_t> live;  // pointer id -> slot
+
+        auto release = [&](uint64_t ptr) {
+            auto it = live.find(ptr);
+            if (it == live.end()) {
+                ++trace.anomalies;
+                return NoSlot;
+            }
+            auto slot = it->second;
+            live.erase(it);
+            return slot;
+        };
+        auto acquire = [&](uint64_t ptr) {
+            auto slot = trace.slotCount++;
+            auto [it, inserted] = live.emplace(ptr, slot);
+            if (!inserted) {
+                // the record that freed it was ordered after this one
+                ++trace.anomalies;
+                it->second = slot;
+            }
+            return slot;
+        };
+
+        for (const auto& r : records) {
+            Op op{ r.op, NoSlot, NoSlot, r.size };
+            switch (r.op) {
+            case mtmalloc::trace_op::malloc:
+                if (r.ptr == 0) {
+                    continue;
+                }
+                op.slot = acquire(r.ptr);
+                break;
+            case mtmalloc::trace_op::free:
+                op.slot = release(r.ptr);
+                if (op.slot == NoSlot) {
+                    continue;
+                }
+                break;
+            case mtmalloc::trace_op::realloc:
+                if (r.old_ptr != 0) {
+                    op.oldSlot = release(r.old_ptr);
+                }
+                if (r.ptr != 0) {
+                    op.slot = acquire(r.ptr);
+                }
+                break;
+            }
+
+            auto [it, inserted] =
+                threadIndex.emplace(r.thread, static_cast<uint32_t>(trace.threads.size()));
+            if (inserted) {
+                trace.threads.emplace_back();
+            }
+            trace.threads[it->second].push_back(static_cast<uint32_t>(trace.ops.size()));
+            trace.ops.push_back(op);
+        }
+        return true;
+    }
+
+    // peak RSS is reset after loading so the trace itself is not counted
+    void resetPeakRss() {
+#if defined(__linux__) || defined(linux)
+        if (auto file = std::fopen("/proc/self/clear_refs", "w")) {
+            std::fputs("5", file);
+            std::fclose(file);
+        }
+#endif
+    }
+
+    size_t peakRssKb() {
+#if defined(__linux__) || defined(linux)
+        if (auto file = std::fopen("/proc/self/status", "r")) {
+            char line[256];
+            size_t res{};
+            while (std::fgets(line, sizeof(line), file)) {
+                if (std::sscanf(line, "VmHWM: %zu kB", &res) == 1) {
+                    break;
+                }
+            }
+            std::fclose(file);
+            if (res != 0) {
+                return res;
+            }
+        }
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+        return static_cast<size_t>(usage.ru_maxrss);
+#else
+        return 0;
+#endif
+    }
+
+    struct Result {
+        double seconds{};
+        size_t peakRssKb{};
+        std::vector<uint64_t> latencies[3];  // ns, indexed by trace_op
+    };
+
+    Result replay(const Trace& trace, const Allocator& alloc, bool strict) {
+        std::vector<std::atomic<void*>> slots(trace.slotCount);
+        for (auto& slot : slots) {
+            slot.store(nullptr, std::memory_order_relaxed);
+        }
+        std::atomic<size_t> cursor{};
+        std::vector<std::vector<uint64_t>> latencies(trace.threads.size() * 3);
+
+        // in deps mode a consumer spins until the producer published the slot
+        auto take = [&](uint32_t slot) -> void* {
+            if (slot == NoSlot) {
+                return nullptr;
+            }
+            void* ptr{};
+            while ((ptr = slots[slot].exchange(nullptr, std::memory_order_acquire)) ==
+                nullptr) {
+                std::this_thread::yield();
+            }
+            return ptr;
+        };
+        auto put = [&](uint32_t slot, void* ptr) {
+            if (slot != NoSlot && ptr != nullptr) {
+                slots[slot].store(ptr, std::memory_order_release);
+            }
+        };
+
+        auto worker = [&](size_t thread) {
+            for (auto index : trace.threads[thread]) {
+                if (strict) {
+                    while (cursor.load(std::memory_order_acquire) != index) {
+                        std::this_thread::yield();
+                    }
+                }
+
+                const auto& op = trace.ops[index];
+                void* ptr{};
+                void* oldPtr{};
+                if (op.op == mtmalloc::trace_op::free) {
+                    ptr = take(op.slot);
+                }
+                else if (op.op == mtmalloc::trace_op::realloc) {
+                    oldPtr = take(op.oldSlot);
+                }
+
+                auto begin = std::chrono::steady_clock::now();
+                switch (op.op) {
+                case mtmalloc::trace_op::malloc:
+                    ptr = alloc.malloc(op.size);
+                    break;
+                case mtmalloc::trace_op::free:
+                    alloc.free(ptr);
+                    break;
+                case mtmalloc::trace_op::realloc:
+                    ptr = alloc.realloc(oldPtr, op.size);
+                    break;
+                }
+                auto end = std::chrono::steady_clock::now();
+
+                if (op.op != mtmalloc::trace_op::free) {
+                    put(op.slot, ptr);
+                }
+                latencies[thread * 3 + static_cast<size_t>(op.op)].push_back(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin)
+                    .count());
+
+                if (strict) {
+                    cursor.store(index + 1, std::memory_order_release);
+                }
+            }
+        };
+
+        resetPeakRss();
+        auto begin = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < trace.threads.size(); ++i) {
+            threads.emplace_back(worker, i);
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        auto end = std::chrono::steady_clock::now();
+
+        Result res;
+        res.seconds = std::chrono::duration<double>(end - begin).count();
+        res.peakRssKb = peakRssKb();
+        for (size_t i = 0; i < latencies.size(); ++i) {
+            auto& dst = res.latencies[i % 3];
+            dst.insert(dst.end(), latencies[i].begin(), latencies[i].end());
+        }
+
+        // leave the allocations that were live at the end of the trace alone:
+        // freeing them could touch memory the trace never freed
+        return res;
+    }
+
+    uint64_t percentile(const std::vector<uint64_t>& sorted, double p) {
+        if (sorted.empty()) {
+            return 0;
+        }
+        auto rank = static_cast<size_t>(p / 100.0 * static_cast<double>(sorted.size() - 1));
+        return sorted[rank];
+    }
+
+    void report(const Trace& trace, const Allocator& alloc, bool strict, Result& res) {
+        static const char* names[3]{ "malloc", "free", "realloc" };
+
+        std::printf("{\n");
+        std::printf("  \"allocator\": \"%s\",\n", alloc.name);
+        std::printf("  \"order\": \"%s\",\n", strict ? "strict" : "deps");
+        std::printf("  \"threads\": %zu,\n", trace.threads.size());
+        std::printf("  \"ops\": %zu,\n", trace.ops.size());
+        std::printf("  \"anomalies\": %llu,\n",
+            static_cast<unsigned long long>(trace.anomalies));
+        std::printf("  \"trace_duration_ns\": %llu,\n",
+            static_cast<unsigned long long>(trace.duration));
+        std::printf("  \"seconds\": %.6f,\n", res.seconds);
+        std::printf("  \"ops_per_sec\": %.0f,\n",
+            res.seconds > 0 ? static_cast<double>(trace.ops.size()) / res.seconds : 0.0);
+        std::printf("  \"peak_rss_kb\": %zu,\n", res.peakRssKb);
+        std::printf("  \"latency_ns\": {\n");
+        for (size_t i = 0; i < 3; ++i) {
+            auto& v = res.latencies[i];
+            std::sort(v.begin(), v.end());
+            std::printf("    \"%s\": { \"count\": %zu, \"p50\": %llu, \"p90\": %llu, "
+                "\"p99\": %llu, \"p999\": %llu, \"max\": %llu }%s\n",
+                names[i], v.size(),
+                static_cast<unsigned long long>(percentile(v, 50)),
+                static_cast<unsigned long long>(percentile(v, 90)),
+                static_cast<unsigned long long>(percentile(v, 99)),
+                static_cast<unsigned long long>(percentile(v, 99.9)),
+                static_cast<unsigned long long>(v.empty() ? 0 : v.back()),
+                i + 1 < 3 ? "," : "");
+        }
+        std::printf("  }\n");
+        std::printf("}\n");
+    }
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    const char* path{};
+    const Allocator* alloc = &mtmallocAllocator;
+    bool strict = true;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--allocator=mtmalloc") {
+            alloc = &mtmallocAllocator;
+        }
+        else if (arg == "--allocator=system") {
+            alloc = &systemAllocator;
+        }
+        else if (arg == "--order=strict") {
+            strict = true;
+        }
+        else if (arg == "--order=deps") {
+            strict = false;
+        }
+        else if (path == nullptr && arg.rfind("--", 0) != 0) {
+            path = argv[i];
+        }
+        else {
+            path = nullptr;
+            break;
+        }
+    }
+    if (path == nullptr) {
+        std::fprintf(stderr,
+            "usage: %s <trace> [--allocator=mtmalloc|system] [--order=strict|deps]\n",
+            argv[0]);
+        return 2;
+    }
+
+    Trace trace;
+    if (!load(path, trace)) {
+        return 1;
+    }
+    auto res = replay(trace, *alloc, strict);
+    report(trace, *alloc, strict, res);
+    return 0;
+}
@@ -0,0 +1,205 @@
+//
+//  mtmalloc_shm_bench.cpp
+//
+//  Two-process throughput of passing messages through a shared heap by
+//  offset, against copying them through a pipe. One JSON object per line.
+//
+//  build: g++ -std=c++17 -O2 -pthread mtmalloc_shm_bench.cpp -o mtmalloc_shm_bench
+//  usage: mtmalloc_shm_bench [messages]
+//
+//  shm   the producer allocates each message in the shared heap and passes
+//        its offset through a ring in the heap; the consumer, which maps the
+//        heap at its own address, reads and frees it
+//  pipe  the producer writes each message into a pipe, the consumer reads
+//        it into a buffer
+//
+
+#include "../mtmalloc_shm.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+    using mtmalloc::shm::offset_t;
+
+    constexpr const char* HeapName = "/mtmalloc_shm_bench";
+    constexpr size_t HeapBytes = size_t{ 256 } << 20;
+    constexpr size_t MaxMessage = 4096;
+
+    struct Message {
+        uint64_t seq;
+        uint32_t size;  // payload bytes
+        unsigned char payload[1];
+    };
+
+    // single producer, single consumer
+    struct Ring {
+        static constexpr size_t Capacity = 4096;
+
+        std::atomic<uint64_t> head;  // next to read
+        std::atomic<uint64_t> tail;  // next to write
+        offset_t slots[Capacity];
+    };
+
+    uint32_t messageSize(uint64_t seq) {
+        // deterministic so both sides agree without sharing state
+        auto x = seq * 0x9E3779B97F4A7C15ull;
+        return static_cast<uint32_t>(64 + (x >> 32) % (MaxMessage - 64));
+    }
+
+    bool check(uint64_t seq, uint32_t size, const unsigned char* payload) {
+        if (size != messageSize(seq)) {
+            return false;
+        }
+        unsigned sum = 0;
+        for (uint32_t i = 0; i < size; ++i) {
+            sum += payload[i];
+        }
+        return sum == (seq & 0xff) * size;
+    }
+
+    void report(const char* mode, size_t messages, size_t bytes, double seconds, bool ok) {
+        std::printf("{\"mode\": \"%s\", \"messages\": %zu, \"seconds\": %.6f, "
+            "\"msgs_per_sec\": %.0f, \"mb_per_sec\": %.1f, \"ok\": %s}\n",
+            mode, messages, seconds, static_cast<double>(messages) / seconds,
+            static_cast<double>(bytes) / seconds / (1 << 20), ok ? "true" : "false");
+        std::fflush(stdout);
+    }
+
+    // returns whether the child exited with status 0
+    bool join(pid_t pid) {
+        int status{};
+        waitpid(pid, &status, 0);
+        return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+
+    void runShm(size_t messages) {
+        mtmalloc::shm::heap::remove(HeapName);
+        auto heap = mtmalloc::shm::heap::create(HeapName, HeapBytes);
+        auto ring = new (heap.allocate(sizeof(Ring))) Ring{};
+        auto ringOffset = heap.to_offset(ring);
+
+        auto pid = fork();
+        if (pid == 0) {
+            // a mapping of its own, at another address than the producer's
+            auto mine = mtmalloc::shm::heap::open(HeapName);
+            auto r = mine.get<Ring>(ringOffset);
+            for (uint64_t seq = 0; seq < messages; ++seq) {
+                auto head = r->head.load(std::memory_order_relaxed);
+                while (r->tail.load(std::memory_order_acquire) == head) {
+                    std::this_thread::yield();
+                }
+                auto msg = mine.get<Message>(r->slots[head % Ring::Capacity]);
+                if (msg->seq != seq || !check(seq, msg->size, msg->payload)) {
+                    std::_Exit(1);
+                }
+                mine.deallocate(msg);
+                r->head.store(head + 1, std::memory_order_release);
+            }
+            std::_Exit(0);
+        }
+
+        size_t bytes = 0;
+        auto begin = std::chrono::steady_clock::now();
+        for (uint64_t seq = 0; seq < messages; ++seq) {
+            auto size = messageSize(seq);
+            auto msg = static_cast<Message*>(heap.allocate(offsetof(Message, payload) + size));
+            msg->seq = seq;
+            msg->size = size;
+            std::memset(msg->payload, static_cast<int>(seq & 0xff), size);
+            bytes += size;
+
+            auto tail = ring->tail.load(std::memory_order_relaxed);
+            while (tail - ring->head.load(std::memory_order_acquire) == Ring::Capacity) {
+                std::this_thread::yield();
+            }
+            ring->slots[tail % Ring::Capacity] = heap.to_offset(msg);
+            ring->tail.store(tail + 1, std::memory_order_release);
+        }
+        auto ok = join(pid);
+        auto seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+        report("shm", messages, bytes, seconds, ok);
+        mtmalloc::shm::heap::remove(HeapName);
+    }
+
+    bool readAll(int fd, void* buf, size_t n) {
+        auto p = static_cast<char*>(buf);
+        while (n > 0) {
+            auto res = read(fd, p, n);
+            if (res <= 0) {
+                return false;
+            }
+            p += res;
+            n -= static_cast<size_t>(res);
+        }
+        return true;
+    }
+
+    bool writeAll(int fd, const void* buf, size_t n) {
+        auto p = static_cast<const char*>(buf);
+        while (n > 0) {
+            auto res = write(fd, p, n);
+            if (res <= 0) {
+                return false;
+            }
+            p += res;
+            n -= static_cast<size_t>(res);
+        }
+        return true;
+    }
+
+    void runPipe(size_t messages) {
+        int fds[2];
+        if (pipe(fds) != 0) {
+            std::perror("pipe");
+            return;
+        }
+
+        auto pid = fork();
+        if (pid == 0) {
+            close(fds[1]);
+            static unsigned char buf[MaxMessage];
+            for (uint64_t seq = 0; seq < messages; ++seq) {
+                uint32_t size{};
+                if (!readAll(fds[0], &size, sizeof(size)) || size > MaxMessage ||
+                    !readAll(fds[0], buf, size) || !check(seq, size, buf)) {
+                    std::_Exit(1);
+                }
+            }
+            std::_Exit(0);
+        }
+        close(fds[0]);
+
+        static unsigned char buf[MaxMessage];
+        size_t bytes = 0;
+        auto begin = std::chrono::steady_clock::now();
+        for (uint64_t seq = 0; seq < messages; ++seq) {
+            auto size = messageSize(seq);
+            std::memset(buf, static_cast<int>(seq & 0xff), size);
+            if (!writeAll(fds[1], &size, sizeof(size)) || !writeAll(fds[1], buf, size)) {
+                break;
+            }
+            bytes += size;
+        }
+        close(fds[1]);
+        auto ok = join(pid);
+        auto seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+        report("pipe", messages, bytes, seconds, ok);
+    }
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    size_t messages = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    runShm(messages);
+    runPipe(messages);
+    return 0;
+}
@@ -0,0 +1,300 @@
+//
+//  shared_ptr_bench.cpp
+//
+//  Creation and access cost of shared objects, one JSON object per line.
+//
+//  build: g++ -std=c++20 -O2 -pthread shared_ptr_bench.cpp -o shared_ptr_bench
+//         (g++ 13 or later, utility.h has static_assert(false) in a template)
+//  usage: shared_ptr_bench [objects] [threads]
+//
+//  Each pointer kind is measured the same way:
+//    create  make and drop objects in batches, ns per object
+//    access  copy each pointer of a shuffled live set, read the object
+//            through the copy and drop it, ns per object. The live set is
+//            created between filler allocations, so objects whose count and
+//            value sit in separate blocks do not share cache lines
+//    copy    threads (default: the hardware threads) copy and drop a
+//            pointer objects times each, ns per copy and drop; "shared"
+//            copies one pointer on every thread, so all of them hit the
+//            same count, "private" copies a pointer of the thread's own.
+//            Kinds with non-atomic counts only run "private" and report
+//            null for "shared"
+//
+//  kinds:
+//    new          mystl::shared_ptr<T>(new T), object and control block
+//                 allocated apart
+//    make_shared  mystl::make_shared<T>, one block through mtmalloc
+//    local        mystl::make_local_shared<T>, make_shared with non-atomic
+//                 counts
+//    biased       mystl::make_biased_shared<T>, make_shared biased to the
+//                 creating thread: "private" copies by the owner, "shared"
+//                 by threads that did not create the object
+//    std          std::make_shared<T>, one block through operator new
+//
+//  publish: 1, 2, 4 ... threads readers read a snapshot objects times each
+//  while one thread republishes it every 10us, ns per read and reader:
+//    snapshot  mystl::atomic_shared_ptr<T>::snapshot, no count traffic
+//    load      mystl::atomic_shared_ptr<T>::load, a shared_ptr copy
+//    mutex     a mystl::shared_ptr copied under a std::mutex
+//
+
+#include "../memory.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace {
+
+    struct Payload {
+        long value;
+        char pad[48];
+
+        explicit Payload(long v) : value{ v }, pad{} {}
+    };
+
+    constexpr size_t Batch = 1000;
+
+    struct NewKind {
+        static constexpr const char* name = "new";
+        static constexpr bool atomic = true;
+        static mystl::shared_ptr<Payload> make(long v) {
+            return mystl::shared_ptr<Payload>(new Payload(v));
+        }
+    };
+
+    struct MakeSharedKind {
+        static constexpr const char* name = "make_shared";
+        static constexpr bool atomic = true;
+        static mystl::shared_ptr<Payload> make(long v) {
+            return mystl::make_shared<Payload>(v);
+        }
+    };
+
+    struct LocalKind {
+        static constexpr const char* name = "local";
+        static constexpr bool atomic = false;
+        static mystl::local_shared_ptr<Payload> make(long v) {
+            return mystl::make_local_shared<Payload>(v);
+        }
+    };
+
+    struct BiasedKind {
+        static constexpr const char* name = "biased";
+        static constexpr bool atomic = true;
+        static mystl::biased_shared_ptr<Payload> make(long v) {
+            return mystl::make_biased_shared<Payload>(v);
+        }
+    };
+
+    struct StdKind {
+        static constexpr const char* name = "std";
+        static constexpr bool atomic = true;
+        static std::shared_ptr<Payload> make(long v) {
+            return std::make_shared<Payload>(v);
+        }
+    };
+
+    double secondsSince(std::chrono::steady_clock::time_point begin) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    }
+
+    template <class Kind>
+    double create(size_t objects) {
+        using Ptr = decltype(Kind::make(0));
+        std::vector<Ptr> batch(Batch);
+
+        auto begin = std::chrono::steady_clock::now();
+        for (size_t done = 0; done < objects; done += Batch) {
+            for (size_t i = 0; i < Batch; ++i) {
+                batch[i] = Kind::make(static_cast<long>(i));
+            }
+            for (auto& ptr : batch) {
+                ptr = Ptr();
+            }
+        }
+        return secondsSince(begin) * 1e9 / static_cast<double>(objects);
+    }
+
+    template <class Kind>
+    double access(size_t objects, long& sink) {
+        using Ptr = decltype(Kind::make(0));
+        std::mt19937_64 random{ 42 };
+        std::uniform_int_distribution<size_t> fillerSize{ 16, 256 };
+
+        std::vector<Ptr> live(objects);
+        std::vector<void*> filler(objects);
+        for (size_t i = 0; i < objects; ++i) {
+            live[i] = Kind::make(static_cast<long>(i));
+            filler[i] = mtmalloc::malloc(fillerSize(random));
+        }
+        std::shuffle(live.begin(), live.end(), random);
+
+        auto begin = std::chrono::steady_clock::now();
+        for (const auto& ptr : live) {
+            Ptr copy = ptr;
+            sink += copy->value;
+        }
+        auto res = secondsSince(begin) * 1e9 / static_cast<double>(objects);
+
+        for (auto ptr : filler) {
+            mtmalloc::free(ptr);
+        }
+        return res;
+    }
+
+    template <class Kind>
+    double copy(size_t objects, size_t threads, bool shared) {
+        using Ptr = decltype(Kind::make(0));
+        auto common = Kind::make(0);
+
+        std::atomic<size_t> ready{};
+        std::atomic<bool> go{};
+        auto worker = [&] {
+            auto own = Kind::make(0);
+            const auto& source = shared ? common : own;
+            ready.fetch_add(1);
+            while (!go.load()) {
+                std::this_thread::yield();
+            }
+            for (size_t i = 0; i < objects; ++i) {
+                Ptr copy = source;
+                // keep each copy's increment and decrement in the loop
+                std::atomic_signal_fence(std::memory_order_seq_cst);
+            }
+        };
+
+        std::vector<std::thread> pool;
+        for (size_t i = 0; i < threads; ++i) {
+            pool.emplace_back(worker);
+        }
+        while (ready.load() != threads) {
+            std::this_thread::yield();
+        }
+        auto begin = std::chrono::steady_clock::now();
+        go.store(true);
+        for (auto& thread : pool) {
+            thread.join();
+        }
+        return secondsSince(begin) * 1e9 / static_cast<double>(objects);
+    }
+
+    template <class Kind>
+    void run(size_t objects, size_t threads, long& sink) {
+        auto createNs = create<Kind>(objects);
+        auto accessNs = access<Kind>(objects, sink);
+        auto privateNs = copy<Kind>(objects, threads, false);
+        char sharedNs[32] = "null";
+        if (Kind::atomic) {
+            std::snprintf(sharedNs, sizeof(sharedNs), "%.1f", copy<Kind>(objects, threads, true));
+        }
+        std::printf("{\"kind\": \"%s\", \"objects\": %zu, \"create_ns\": %.1f, "
+            "\"access_ns\": %.1f, \"threads\": %zu, \"copy_shared_ns\": %s, "
+            "\"copy_private_ns\": %.1f}\n",
+            Kind::name, objects, createNs, accessNs, threads, sharedNs, privateNs);
+        std::fflush(stdout);
+    }
+
+    // reader ns per read while a writer replaces the value
+    template <class Read, class Write>
+    double readers(size_t objects, size_t threads, long& sink, Read read, Write write) {
+        std::atomic<long> total{};
+        std::atomic<size_t> ready{};
+        std::atomic<size_t> running{};
+        std::atomic<bool> go{};
+        auto reader = [&] {
+            long sum = 0;
+            ready.fetch_add(1);
+            while (!go.load()) {
+                std::this_thread::yield();
+            }
+            for (size_t i = 0; i < objects; ++i) {
+                sum += read();
+            }
+            total.fetch_add(sum);
+            running.fetch_sub(1);
+        };
+
+        running.store(threads);
+        std::vector<std::thread> pool;
+        for (size_t i = 0; i < threads; ++i) {
+            pool.emplace_back(reader);
+        }
+        while (ready.load() != threads) {
+            std::this_thread::yield();
+        }
+        auto begin = std::chrono::steady_clock::now();
+        go.store(true);
+        for (long v = 1; running.load() != 0; ++v) {
+            write(v);
+            std::this_thread::sleep_for(std::chrono::microseconds(10));
+        }
+        for (auto& thread : pool) {
+            thread.join();
+        }
+        auto res = secondsSince(begin) * 1e9 / static_cast<double>(objects);
+        sink += total.load();
+        return res;
+    }
+
+    void publish(size_t objects, size_t threads, long& sink) {
+        for (size_t n = 1;; n = std::min(n * 2, threads)) {
+            mystl::atomic_shared_ptr<Payload> current{ mystl::make_shared<Payload>(0) };
+            auto write = [&](long v) { current.store(mystl::make_shared<Payload>(v)); };
+            auto snapshotNs = readers(objects, n, sink, [&] {
+                return current.snapshot()->value;
+            }, write);
+            auto loadNs = readers(objects, n, sink, [&] {
+                return current.load()->value;
+            }, write);
+
+            std::mutex mutex;
+            auto locked = mystl::make_shared<Payload>(0);
+            auto mutexNs = readers(objects, n, sink, [&] {
+                mystl::shared_ptr<Payload> ptr;
+                {
+                    std::lock_guard<std::mutex> lock{ mutex };
+                    ptr = locked;
+                }
+                return ptr->value;
+            }, [&](long v) {
+                auto fresh = mystl::make_shared<Payload>(v);
+                std::lock_guard<std::mutex> lock{ mutex };
+                locked.swap(fresh);
+            });
+
+            std::printf("{\"publish\": \"atomic_shared_ptr\", \"objects\": %zu, "
+                "\"readers\": %zu, \"snapshot_ns\": %.1f, \"load_ns\": %.1f, "
+                "\"mutex_ns\": %.1f}\n", objects, n, snapshotNs, loadNs, mutexNs);
+            std::fflush(stdout);
+            if (n == threads) {
+                break;
+            }
+        }
+    }
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    size_t objects = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    objects = std::max(objects / Batch, size_t{ 1 }) * Batch;
+    size_t threads = argc > 2 ? std::strtoull(argv[2], nullptr, 10)
+                              : std::thread::hardware_concurrency();
+    threads = std::max(threads, size_t{ 1 });
+
+    long sink = 0;
+    run<NewKind>(objects, threads, sink);
+    run<MakeSharedKind>(objects, threads, sink);
+    run<LocalKind>(objects, threads, sink);
+    run<BiasedKind>(objects, threads, sink);
+    run<StdKind>(objects, threads, sink);
+    publish(objects, threads, sink);
+    return sink == 42 ? 1 : 0;
+}
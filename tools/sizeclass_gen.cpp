@@ -0,0 +1,332 @@
+//
+//  sizeclass_gen.cpp
+//
+//  Compute a size-class table for a workload and write it as a header that
+//  mtmalloc compiles in instead of its default classes.
+//
+//  build: g++ -std=c++17 -O2 -pthread sizeclass_gen.cpp -o sizeclass_gen
+//  usage: sizeclass_gen <trace|histogram> [--classes=N] [--max-step=R] > size_classes.h
+//         g++ ... -DMTMALLOC_SIZE_CLASSES_HEADER='"size_classes.h"' app.cpp
+//
+//  The input is a trace recorded with MTMALLOC_TRACE, whose malloc and
+//  realloc sizes are counted, or a text histogram of "bytes count" lines
+//  (# starts a comment), e.g. dumped from an application's own counters.
+//  Requests above 256KB never use a class and are ignored.
+//
+//  The table minimizes the bytes wasted per request: the class size minus
+//  the requested bytes, plus the tail of its span that fits no memblock,
+//  shared by the memblocks of the span. Span sizes follow MTMALLOC_CONF and
+//  the page size the tool was built with, so build and run it as the
+//  application is.
+//
+//  --classes=N   at most N classes, up to 256 (default 128)
+//  --max-step=R  a class is at most R larger than the one below it, or one
+//                alignment step, so sizes missing from the input waste at
+//                most about R (default 0.125, 0 for no bound)
+//
+//  Classes up to 1KB are multiples of 8, larger ones multiples of 128, and
+//  the last is 256KB. A summary comparing the table with the one the tool
+//  was built with goes to stderr as JSON.
+//
+
+#include "../mtmalloc.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+namespace {
+
+    using mtmalloc::detail::Helper;
+    using mtmalloc::detail::PageShift;
+    using mtmalloc::detail::TCMaxSize;
+
+    // requests by size, index is bytes
+    using Histogram = std::vector<double>;
+
+    bool loadTrace(std::FILE* file, Histogram& hist) {
+        mtmalloc::trace_header header{};
+        if (std::fread(&header, sizeof(header), 1, file) != 1 ||
+            std::memcmp(header.magic, mtmalloc::trace_magic, sizeof(header.magic)) != 0) {
+            return false;
+        }
+        if (header.version != mtmalloc::trace_version ||
+            header.record_size != sizeof(mtmalloc::trace_record)) {
+            std::fprintf(stderr, "unsupported trace version\n");
+            return false;
+        }
+
+        mtmalloc::trace_record record{};
+        while (std::fread(&record, sizeof(record), 1, file) == 1) {
+            auto counted = record.op == mtmalloc::trace_op::malloc ||
+                (record.op == mtmalloc::trace_op::realloc && record.ptr != 0);
+            if (counted && record.size > 0 && record.size <= TCMaxSize) {
+                hist[record.size] += 1;
+            }
+        }
+        return true;
+    }
+
+    bool loadText(std::FILE* file, Histogram& hist) {
+        char line[256];
+        size_t lineNo = 0;
+        while (std::fgets(line, sizeof(line), file)) {
+            ++lineNo;
+            if (auto comment = std::strchr(line, '#')) {
+                *comment = '\0';
+            }
+            unsigned long long bytes{};
+            double count = 1;
+            auto n = std::sscanf(line, "%llu %lf", &bytes, &count);
+            if (n <= 0) {
+                continue;
+            }
+            if (count < 0) {
+                std::fprintf(stderr, "line %zu: negative count\n", lineNo);
+                return false;
+            }
+            if (bytes > 0 && bytes <= TCMaxSize) {
+                hist[bytes] += count;
+            }
+        }
+        return true;
+    }
+
+    bool load(const char* path, Histogram& hist) {
+        auto file = std::fopen(path, "rb");
+        if (file == nullptr) {
+            std::fprintf(stderr, "cannot open %s\n", path);
+            return false;
+        }
+
+        hist.assign(TCMaxSize + 1, 0);
+        char magic[sizeof(mtmalloc::trace_magic)]{};
+        auto isTrace = std::fread(magic, sizeof(magic), 1, file) == 1 &&
+            std::memcmp(magic, mtmalloc::trace_magic, sizeof(magic)) == 0;
+        std::rewind(file);
+
+        auto res = isTrace ? loadTrace(file, hist) : loadText(file, hist);
+        std::fclose(file);
+        return res;
+    }
+
+    // span tail bytes charged to each memblock of a class
+    double tailWaste(size_t size) {
+        auto bytes = Helper::sizeToPageNum(size) << PageShift;
+        return static_cast<double>(bytes % size) / static_cast<double>(bytes / size);
+    }
+
+    // prefix sums over bytes and the tails of every multiple of 8, so the
+    // cost of a class is O(1)
+    class Cost {
+    public:
+        explicit Cost(const Histogram& hist)
+            : count_(hist.size() + 1), bytes_(hist.size() + 1), tails_(TCMaxSize / 8 + 1) {
+            for (size_t i = 0; i < hist.size(); ++i) {
+                count_[i + 1] = count_[i] + hist[i];
+                bytes_[i + 1] = bytes_[i] + hist[i] * static_cast<double>(i);
+            }
+            for (size_t i = 1; i < tails_.size(); ++i) {
+                tails_[i] = tailWaste(i * 8);
+            }
+        }
+
+        // waste of a class of size serving requests in (prev, size]
+        double operator()(size_t prev, size_t size) const {
+            auto count = count_[size + 1] - count_[prev + 1];
+            auto bytes = bytes_[size + 1] - bytes_[prev + 1];
+            return count * (static_cast<double>(size) + tails_[size / 8]) - bytes;
+        }
+
+        double requests() const { return count_.back(); }
+        double requestedBytes() const { return bytes_.back(); }
+
+    private:
+        std::vector<double> count_;
+        std::vector<double> bytes_;
+        std::vector<double> tails_;
+    };
+
+    struct Summary {
+        double internal{};  // class size minus requested bytes
+        double tail{};      // span tails
+    };
+
+    Summary summarize(const Histogram& hist, const std::vector<size_t>& classes) {
+        Summary res;
+        size_t prev = 0;
+        for (auto size : classes) {
+            auto tail = tailWaste(size);
+            for (auto bytes = prev + 1; bytes <= size; ++bytes) {
+                res.internal += hist[bytes] * static_cast<double>(size - bytes);
+                res.tail += hist[bytes] * tail;
+            }
+            prev = size;
+        }
+        return res;
+    }
+
+    std::vector<size_t> currentClasses() {
+        std::vector<size_t> res;
+        for (auto size = Helper::bytesToSize(1);; size = Helper::bytesToSize(size + 1)) {
+            res.push_back(size);
+            if (size >= TCMaxSize) {
+                return res;
+            }
+        }
+    }
+
+    std::vector<size_t> candidates() {
+        std::vector<size_t> res;
+        for (size_t size = 8; size <= 1024; size += 8) {
+            res.push_back(size);
+        }
+        for (size_t size = 1024 + 128; size <= TCMaxSize; size += 128) {
+            res.push_back(size);
+        }
+        return res;
+    }
+
+    // best[k][j] is the least waste of k classes ending with sizes[j], which
+    // serve every request up to sizes[j]
+    std::vector<size_t> optimize(const Histogram& hist, size_t budget, double maxStep) {
+        auto sizes = candidates();
+        auto m = sizes.size();
+        Cost cost{ hist };
+
+        auto reachable = [&](size_t prev, size_t size) {
+            auto step = size <= 1024 ? size_t{ 8 } : size_t{ 128 };
+            return maxStep <= 0 ||
+                size - prev <= std::max(step, static_cast<size_t>(prev * maxStep));
+        };
+
+        constexpr auto inf = std::numeric_limits<double>::infinity();
+        std::vector<std::vector<double>> best(budget + 1, std::vector<double>(m, inf));
+        std::vector<std::vector<uint32_t>> from(budget + 1, std::vector<uint32_t>(m));
+        for (size_t j = 0; j < m && reachable(0, sizes[j]); ++j) {
+            best[1][j] = cost(0, sizes[j]);
+        }
+        for (size_t k = 2; k <= budget; ++k) {
+            for (size_t j = 1; j < m; ++j) {
+                // candidates below j, nearest first, until out of reach
+                for (auto i = j; i-- > 0 && reachable(sizes[i], sizes[j]);) {
+                    if (best[k - 1][i] == inf) {
+                        continue;
+                    }
+                    auto c = best[k - 1][i] + cost(sizes[i], sizes[j]);
+                    if (c < best[k][j]) {
+                        best[k][j] = c;
+                        from[k][j] = static_cast<uint32_t>(i);
+                    }
+                }
+            }
+        }
+
+        // fewest classes among the equally good ones
+        size_t k = 0;
+        for (size_t i = 1; i <= budget; ++i) {
+            if (best[i][m - 1] < (k == 0 ? inf : best[k][m - 1])) {
+                k = i;
+            }
+        }
+        std::vector<size_t> res;
+        if (k == 0) {
+            return res;
+        }
+        for (auto j = m - 1;; j = from[k--][j]) {
+            res.push_back(sizes[j]);
+            if (k == 1) {
+                break;
+            }
+        }
+        return { res.rbegin(), res.rend() };
+    }
+
+    void writeHeader(std::FILE* out, const char* input, const std::vector<size_t>& classes,
+        double wastePercent) {
+        std::fprintf(out, "//\n");
+        std::fprintf(out, "//  Generated by sizeclass_gen from %s: %zu classes, %.2f%% of\n",
+            input, classes.size(), wastePercent);
+        std::fprintf(out, "//  requested bytes wasted, %zuKB pages.\n",
+            (size_t{ 1 } << PageShift) >> 10);
+        std::fprintf(out, "//\n");
+        std::fprintf(out, "//  build: -DMTMALLOC_SIZE_CLASSES_HEADER='\"<this file>\"'\n");
+        std::fprintf(out, "//\n\n");
+        std::fprintf(out, "#ifndef MTMALLOC_SIZE_CLASSES_H\n");
+        std::fprintf(out, "#define MTMALLOC_SIZE_CLASSES_H\n\n");
+        std::fprintf(out, "#include <cstddef>\n\n");
+        std::fprintf(out, "namespace mtmalloc::detail {\n\n");
+        std::fprintf(out, "    inline constexpr size_t SizeClasses[]{");
+        for (size_t i = 0; i < classes.size(); ++i) {
+            std::fprintf(out, "%s%zu,", i % 8 == 0 ? "\n        " : " ", classes[i]);
+        }
+        std::fprintf(out, "\n    };\n\n");
+        std::fprintf(out, "}  // namespace mtmalloc::detail\n\n");
+        std::fprintf(out, "#endif\n");
+    }
+
+    double percent(const Summary& summary, double requested) {
+        return requested > 0 ? 100.0 * (summary.internal + summary.tail) / requested : 0.0;
+    }
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    const char* path{};
+    size_t budget = 128;
+    double maxStep = 0.125;
+
+    for (int i = 1; i < argc; ++i) {
+        if (std::strncmp(argv[i], "--classes=", 10) == 0) {
+            budget = std::strtoull(argv[i] + 10, nullptr, 10);
+        }
+        else if (std::strncmp(argv[i], "--max-step=", 11) == 0) {
+            maxStep = std::strtod(argv[i] + 11, nullptr);
+        }
+        else if (path == nullptr && std::strncmp(argv[i], "--", 2) != 0) {
+            path = argv[i];
+        }
+        else {
+            path = nullptr;
+            break;
+        }
+    }
+    if (path == nullptr || budget == 0 || budget > 256) {
+        std::fprintf(stderr,
+            "usage: %s <trace|histogram> [--classes=N] [--max-step=R] > size_classes.h\n",
+            argv[0]);
+        return 2;
+    }
+
+    Histogram hist;
+    if (!load(path, hist)) {
+        return 1;
+    }
+
+    auto classes = optimize(hist, budget, maxStep);
+    if (classes.empty()) {
+        std::fprintf(stderr, "%zu classes cannot reach 256KB with --max-step=%g\n", budget,
+            maxStep);
+        return 1;
+    }
+
+    Cost cost{ hist };
+    auto requested = cost.requestedBytes();
+    auto current = currentClasses();
+    auto before = summarize(hist, current);
+    auto after = summarize(hist, classes);
+
+    writeHeader(stdout, path, classes, percent(after, requested));
+    std::fprintf(stderr, "{\"requests\": %.0f, \"requested_bytes\": %.0f, "
+        "\"current\": {\"classes\": %zu, \"internal_bytes\": %.0f, \"tail_bytes\": %.0f, "
+        "\"waste_percent\": %.2f}, "
+        "\"generated\": {\"classes\": %zu, \"internal_bytes\": %.0f, \"tail_bytes\": %.0f, "
+        "\"waste_percent\": %.2f}}\n",
+        cost.requests(), requested,
+        current.size(), before.internal, before.tail, percent(before, requested),
+        classes.size(), after.internal, after.tail, percent(after, requested));
+    return 0;
+}